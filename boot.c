@@ -198,6 +198,10 @@ const uint8_t paramBlock[] __at(0x820) = {
 
 
 static const char bl_version[] = { 'B','L','_','V','E','R','S','I','O','N','='};
+/** The number of bytes of the bootloader read at once when searching for bl_version.*/
+#define BOOT_SCAN_CHUNK     32
+/** The bytes of bl_version together with the type and version bytes.*/
+#define BOOT_SCAN_MATCH     13
 static uint8_t bootloaderType;
 static uint8_t bootloaderVersion;
 
@@ -207,29 +211,31 @@ static uint8_t bootloaderVersion;
 void bootPowerUp(void) {
     uint24_t a;
     uint8_t i;
-    uint8_t b;
+    uint8_t j;
     uint8_t found;
+    uint8_t chunk[BOOT_SCAN_CHUNK];
     
     bootloaderType = BL_TYPE_Unknown;
     bootloaderVersion = 0;
     
     // attempt to find the bl_version string within the bootloader
-    for (a=0; a<0x7FF; a++) {
-        found = 1;
-        for (i=0; i<11; i++) {
-            b = (uint8_t)readNVM(FLASH_NVM_TYPE, a+i);
-            if (b != bl_version[i]) {
-                found = 0;
-                break;
-            } else {
-                found = 1;
+    // chunks overlap so that a string followed by type and version is never split
+    for (a=0; a<0x7FF; a+=BOOT_SCAN_CHUNK-BOOT_SCAN_MATCH+1) {
+        readNVMBlock(FLASH_NVM_TYPE, a, chunk, BOOT_SCAN_CHUNK);
+        for (j=0; j<=BOOT_SCAN_CHUNK-BOOT_SCAN_MATCH; j++) {
+            found = 1;
+            for (i=0; i<11; i++) {
+                if (chunk[j+i] != bl_version[i]) {
+                    found = 0;
+                    break;
+                }
             }
+            if (found) {
+                bootloaderType = chunk[j+11];
+                bootloaderVersion = chunk[j+12];
+                return;
+            } 
         }
-        if (found) {
-            bootloaderType = (uint8_t)readNVM(FLASH_NVM_TYPE, a+11);
-            bootloaderVersion = (uint8_t)readNVM(FLASH_NVM_TYPE, a+12);
-            return;
-        } 
     }
 }
 /**
@@ -247,6 +253,8 @@ static Processed bootProcessMessage(Message * m) {
         case OPC_BOOT:
             // Set the bootloader flag to be picked up by the bootloader
             writeNVM(BOOT_FLAG_NVM_TYPE, BOOT_FLAG_ADDRESS, 0xFF); 
+            flushFlashBlock();
+            flushEepromQueue();
             RESET();     // will enter the bootloader
             return PROCESSED;
         default:
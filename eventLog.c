@@ -0,0 +1,436 @@
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * @brief
+ * Append only, wear levelled storage for the event table in flash.
+ * @details
+ * See eventLog.h for a description of the log.
+ * 
+ * Each flash page of the log holds EVENT_LOG_RECORDS_PER_PAGE records. A record
+ * consists of the row number followed by EVENTTABLE_ROW_WIDTH bytes of the row.
+ * An unused record has a row number of 0xFF. Records are appended in order 
+ * so the records within a page are contiguous and the used pages are a 
+ * contiguous section of the ring from the tail (oldest) page to the head page.
+ * The remaining pages of the ring are erased.
+ * 
+ * At least EVENT_LOG_RESERVE_PAGES erased pages are kept before a new head page
+ * is started outside of garbage collection. Collecting a page copies at most a
+ * page of records so may start one more page, which still leaves one page 
+ * erased until the tail page has been erased.
+ */
+
+#include "xc.h"
+#include <string.h> // for memcpy and memset
+#include "module.h"
+#include "vlcb.h"
+#include "nvm.h"
+#include "event_teach_large.h"
+#include "eventLog.h"
+
+#ifdef EVENT_TABLE_LOG
+
+/** The number of bytes in a record.*/
+#define EVENT_LOG_RECORD_WIDTH      (1 + EVENTTABLE_ROW_WIDTH)
+/** The number of records held in each flash page.*/
+#define EVENT_LOG_RECORDS_PER_PAGE  (FLASH_PAGE_SIZE / EVENT_LOG_RECORD_WIDTH)
+/** The number of records held in the log.*/
+#define EVENT_LOG_RECORDS           (EVENT_LOG_PAGES * EVENT_LOG_RECORDS_PER_PAGE)
+/** The number of erased pages garbage collection tries to keep available.*/
+#define EVENT_LOG_SPARE_PAGES       4
+/** The fewest erased pages there may be before a new head page is started.*/
+#define EVENT_LOG_RESERVE_PAGES     3
+
+#if EVENT_LOG_PAGES > 255
+#error "EVENT_LOG_PAGES too large, maximum is 255"
+#endif
+#if EVENT_LOG_RECORDS < NUM_EVENTS + EVENT_LOG_RESERVE_PAGES*EVENT_LOG_RECORDS_PER_PAGE
+#error "EVENT_LOG_PAGES too small for NUM_EVENTS"
+#endif
+
+/*
+ * The record number of the latest record of each row.
+ */
+#if EVENT_LOG_RECORDS < 255
+typedef uint8_t LogRecord;
+#define NO_RECORD   0xFF
+#else
+typedef uint16_t LogRecord;
+#define NO_RECORD   0xFFFF
+#endif
+static LogRecord rowRecord[NUM_EVENTS];
+
+static uint8_t headPage;        // the page records are appended to
+static uint8_t headSlot;        // the next unused record in the head page
+static uint8_t tailPage;        // the oldest page containing records
+static uint8_t erasedPages;     // the number of erased pages
+
+/*
+ * The row currently being changed. Changes are collected here until the row is
+ * appended to the log.
+ */
+static uint8_t openRow;
+static Boolean openRowChanged;
+static uint8_t openRowData[EVENTTABLE_ROW_WIDTH];
+
+static uint24_t recordAddress(LogRecord r);
+static uint8_t nextPage(uint8_t page);
+static void eraseLogPage(uint8_t page);
+static Boolean appendRecord(uint8_t row, uint24_t source);
+static void collectPage(void);
+static uint8_t supersededRecords(uint8_t page);
+static void commitOpenRow(void);
+
+/** Address of the start of a page of the log.*/
+#define PAGE_ADDRESS(p)     (EVENT_LOG_ADDRESS + (uint24_t)FLASH_PAGE_SIZE*(p))
+
+/**
+ * Rebuild the RAM index from the records in flash.
+ */
+void initEventLog(void) {
+    uint8_t page;
+    uint8_t slot;
+    uint8_t row;
+    LogRecord r;
+    
+    openRow = NO_INDEX;
+    openRowChanged = FALSE;
+    for (row=0; row<NUM_EVENTS; row++) {
+        rowRecord[row] = NO_RECORD;
+    }
+    // count the erased pages and find the head, the used page before an erased page
+    erasedPages = 0;
+    headPage = EVENT_LOG_PAGES-1;
+    for (page=0; page<EVENT_LOG_PAGES; page++) {
+        if (readNVM(FLASH_NVM_TYPE, PAGE_ADDRESS(page)) == 0xFF) {
+            erasedPages++;
+        } else if (readNVM(FLASH_NVM_TYPE, PAGE_ADDRESS(nextPage(page))) == 0xFF) {
+            headPage = page;
+        }
+    }
+    if (erasedPages == 0) {
+        // The log is corrupt as there is always an erased page after the head.
+        // Start again rather than replay the records in an unknown order.
+        clearEventLog();
+        return;
+    }
+    if (erasedPages == EVENT_LOG_PAGES) {
+        // empty log, the next record starts page 0
+        headSlot = EVENT_LOG_RECORDS_PER_PAGE;
+        tailPage = 0;
+        return;
+    }
+    // the tail is the first used page after the head
+    tailPage = nextPage(headPage);
+    while (readNVM(FLASH_NVM_TYPE, PAGE_ADDRESS(tailPage)) == 0xFF) {
+        tailPage = nextPage(tailPage);
+    }
+    // replay the records from oldest to newest so the latest record of each row wins
+    page = tailPage;
+    for (;;) {
+        r = (LogRecord)page*EVENT_LOG_RECORDS_PER_PAGE;
+        for (slot=0; slot<EVENT_LOG_RECORDS_PER_PAGE; slot++, r++) {
+            row = (uint8_t)readNVM(FLASH_NVM_TYPE, recordAddress(r));
+            if (row == 0xFF) break;
+            if (row < NUM_EVENTS) {
+                rowRecord[row] = r;
+            }
+        }
+        if (page == headPage) {
+            headSlot = slot;
+            break;
+        }
+        page = nextPage(page);
+    }
+}
+
+/**
+ * Erase the log so that every row of the event table is free.
+ */
+void clearEventLog(void) {
+    uint8_t page;
+    uint8_t row;
+    
+    for (page=0; page<EVENT_LOG_PAGES; page++) {
+        if (readNVM(FLASH_NVM_TYPE, PAGE_ADDRESS(page)) != 0xFF) {
+            eraseLogPage(page);
+        }
+    }
+    flushFlashBlock();
+    openRow = NO_INDEX;
+    openRowChanged = FALSE;
+    for (row=0; row<NUM_EVENTS; row++) {
+        rowRecord[row] = NO_RECORD;
+    }
+    erasedPages = EVENT_LOG_PAGES;
+    headPage = EVENT_LOG_PAGES-1;
+    headSlot = EVENT_LOG_RECORDS_PER_PAGE;
+    tailPage = 0;
+}
+
+/**
+ * Read a byte of the event table.
+ * @param address the address within the event table
+ * @return the value
+ */
+int16_t readEventLog(uint16_t address) {
+    uint8_t row;
+    LogRecord r;
+    
+    row = (uint8_t)(address / EVENTTABLE_ROW_WIDTH);
+    if (row == openRow) {
+        return openRowData[address % EVENTTABLE_ROW_WIDTH];
+    }
+    r = rowRecord[row];
+    if (r == NO_RECORD) {
+        return 0xFF;
+    }
+    return readNVM(FLASH_NVM_TYPE, recordAddress(r) + 1 + address % EVENTTABLE_ROW_WIDTH);
+}
+
+/**
+ * Read a sequence of bytes of the event table which must all be in the same row.
+ * @param address the address within the event table of the first byte
+ * @param buffer where the bytes are to be put
+ * @param length the number of bytes
+ */
+void readEventLogBlock(uint16_t address, uint8_t * buffer, uint8_t length) {
+    uint8_t row;
+    LogRecord r;
+    
+    row = (uint8_t)(address / EVENTTABLE_ROW_WIDTH);
+    if (row == openRow) {
+        memcpy(buffer, &openRowData[address % EVENTTABLE_ROW_WIDTH], length);
+        return;
+    }
+    r = rowRecord[row];
+    if (r == NO_RECORD) {
+        memset(buffer, 0xFF, length);
+        return;
+    }
+    readNVMBlock(FLASH_NVM_TYPE, recordAddress(r) + 1 + address % EVENTTABLE_ROW_WIDTH, buffer, length);
+}
+
+/**
+ * Write a byte of the event table. 
+ * @param address the address within the event table
+ * @param value the value to be written
+ * @return 0 for success or error otherwise
+ */
+uint8_t writeEventLog(uint16_t address, uint8_t value) {
+    uint8_t row;
+    uint8_t i;
+    
+    row = (uint8_t)(address / EVENTTABLE_ROW_WIDTH);
+    if (row != openRow) {
+        commitOpenRow();
+        // load the current contents of the row
+        for (i=0; i<EVENTTABLE_ROW_WIDTH; i++) {
+            openRowData[i] = (uint8_t)readEventLog((uint16_t)row*EVENTTABLE_ROW_WIDTH + i);
+        }
+        openRow = row;
+    }
+    if (openRowData[address % EVENTTABLE_ROW_WIDTH] != value) {
+        openRowData[address % EVENTTABLE_ROW_WIDTH] = value;
+        openRowChanged = TRUE;
+    }
+    return GRSP_OK;
+}
+
+/**
+ * Append a record for any changed row and write it to flash.
+ */
+void flushEventLog(void) {
+    commitOpenRow();
+    flushFlashBlock();
+}
+
+/**
+ * Append a record for any changed row and request that it is written to flash
+ * by pollNVM() without blocking.
+ * @param callback function called when the record is in flash, may be NULL
+ */
+void requestEventLogFlush(FlashFlushCallback callback) {
+    commitOpenRow();
+    requestFlashFlush(callback);
+}
+
+/**
+ * Called regularly to append a record for any changed row and to garbage
+ * collect the oldest page when the number of erased pages is low. Pages are
+ * only collected in the background if doing so frees some records.
+ */
+void pollEventLog(void) {
+    commitOpenRow();
+    if (erasedPages >= EVENT_LOG_SPARE_PAGES) return;
+    if (supersededRecords(tailPage) == 0) return;
+    if (APP_isSuitableTimeToWriteFlash() == BAD_TIME) return;
+    collectPage();
+}
+
+/**
+ * Append the open row to the log if it has been changed.
+ */
+static void commitOpenRow(void) {
+    if ((openRow == NO_INDEX) || (! openRowChanged)) return;
+    if (headSlot >= EVENT_LOG_RECORDS_PER_PAGE) {
+        // Erased pages are kept in reserve for garbage collection so make
+        // sure there will still be enough after starting a new page
+        uint8_t tries;
+        for (tries=0; (tries<EVENT_LOG_PAGES) && (erasedPages < EVENT_LOG_RESERVE_PAGES); tries++) {
+            collectPage();
+        }
+    }
+    if (appendRecord(openRow, 0)) {
+        openRowChanged = FALSE;
+    }
+}
+
+/**
+ * Append a record to the head of the log.
+ * @param row the row of the event table
+ * @param source the address of an existing record to be copied or 0 to use the open row
+ * @return TRUE if the record was appended, FALSE if that would leave no erased page
+ */
+static Boolean appendRecord(uint8_t row, uint24_t source) {
+    uint24_t address;
+    uint8_t i;
+    
+    if (headSlot >= EVENT_LOG_RECORDS_PER_PAGE) {
+        // never use the last erased page, the head could not then be found
+        if (erasedPages <= 1) return FALSE;
+        headPage = nextPage(headPage);
+        headSlot = 0;
+        erasedPages--;
+    }
+    rowRecord[row] = (LogRecord)headPage*EVENT_LOG_RECORDS_PER_PAGE + headSlot;
+    headSlot++;
+    address = recordAddress(rowRecord[row]);
+    writeNVM(FLASH_NVM_TYPE, address, row);
+    for (i=0; i<EVENTTABLE_ROW_WIDTH; i++) {
+        writeNVM(FLASH_NVM_TYPE, address+1+i, (source == 0) ? openRowData[i] : 
+                (uint8_t)readNVM(FLASH_NVM_TYPE, source+1+i));
+    }
+    return TRUE;
+}
+
+/**
+ * Garbage collect the tail page. Records in the tail page which are still the 
+ * latest for their row are copied to the head of the log and then the tail 
+ * page is erased. Must only be called with at least 2 erased pages so that one
+ * remains erased if the copies start a new page.
+ */
+static void collectPage(void) {
+    uint8_t slot;
+    uint8_t row;
+    LogRecord r;
+    
+    r = (LogRecord)tailPage*EVENT_LOG_RECORDS_PER_PAGE;
+    for (slot=0; slot<EVENT_LOG_RECORDS_PER_PAGE; slot++, r++) {
+        row = (uint8_t)readNVM(FLASH_NVM_TYPE, recordAddress(r));
+        if (row == 0xFF) break;
+        if ((row < NUM_EVENTS) && (rowRecord[row] == r)) {
+            if ( ! appendRecord(row, recordAddress(r))) {
+                // no room to copy the record so the page cannot be erased
+                flushFlashBlock();
+                return;
+            }
+        }
+    }
+    // the copies are written before the page is erased
+    flushFlashBlock();
+    eraseLogPage(tailPage);
+    flushFlashBlock();
+    erasedPages++;
+    tailPage = nextPage(tailPage);
+}
+
+/**
+ * Count the records in a page which are no longer the latest for their row.
+ * @param page the page of the log
+ * @return the number of superseded records
+ */
+static uint8_t supersededRecords(uint8_t page) {
+    uint8_t slot;
+    uint8_t row;
+    uint8_t count;
+    LogRecord r;
+    
+    count = 0;
+    r = (LogRecord)page*EVENT_LOG_RECORDS_PER_PAGE;
+    for (slot=0; slot<EVENT_LOG_RECORDS_PER_PAGE; slot++, r++) {
+        row = (uint8_t)readNVM(FLASH_NVM_TYPE, recordAddress(r));
+        if (row == 0xFF) break;
+        if ((row >= NUM_EVENTS) || (rowRecord[row] != r)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Erase a page of the log. Setting every byte to 0xFF causes the page to be 
+ * erased when it is flushed.
+ * @param page the page of the log
+ */
+static void eraseLogPage(uint8_t page) {
+    uint16_t i;
+    
+    for (i=0; i<FLASH_PAGE_SIZE; i++) {
+        writeNVM(FLASH_NVM_TYPE, PAGE_ADDRESS(page) + i, 0xFF);
+    }
+}
+
+/**
+ * Get the flash address of a record.
+ * @param r the record number
+ * @return the address
+ */
+static uint24_t recordAddress(LogRecord r) {
+    return PAGE_ADDRESS(r / EVENT_LOG_RECORDS_PER_PAGE) + 
+            EVENT_LOG_RECORD_WIDTH*(r % EVENT_LOG_RECORDS_PER_PAGE);
+}
+
+/**
+ * Get the page following a page in the ring.
+ * @param page the page of the log
+ * @return the next page
+ */
+static uint8_t nextPage(uint8_t page) {
+    page++;
+    if (page >= EVENT_LOG_PAGES) {
+        page = 0;
+    }
+    return page;
+}
+
+#endif
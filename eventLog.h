@@ -0,0 +1,123 @@
+#ifndef _EVENT_LOG_H_
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+#define _EVENT_LOG_H_
+
+#include "xc.h"
+#include "module.h"
+#include "nvm.h"
+
+/**
+ * @file
+ * @brief
+ * Append only, wear levelled storage for the event table in flash.
+ * @details
+ * When EVENT_TABLE_LOG is defined in module.h the rows of the event_teach_large
+ * event table are not stored at fixed addresses. Instead each change to a row
+ * appends a record, containing the row number and the new contents of the row,
+ * to a ring of reserved flash pages. A RAM index holds the location of the latest 
+ * record for each row. 
+ * 
+ * Appending a record only clears bits in flash which has previously been erased 
+ * so a teach costs a page write without an erase. The pages of the ring are 
+ * used in turn spreading the wear across the reserved area.
+ * 
+ * When the ring is nearly full the oldest page is garbage collected by copying
+ * any records which are still the latest for their row to the head of the log
+ * and then erasing the page. This is done in the background from pollEventLog()
+ * and only done in the foreground if a record must be written and there are 
+ * too few erased pages. At least one page of the ring is always left erased,
+ * even part way through garbage collection, so that the head of the log can be
+ * found at power up as the used page followed by an erased page.
+ * 
+ * A row for which there is no record reads as erased (0xFF) i.e. free.
+ * 
+ * # Module.h definitions
+ * - \#define EVENT_TABLE_LOG     Use the log for the event table.
+ * - \#define EVENT_LOG_ADDRESS   The address of the flash reserved for the log.
+ *                       Must be aligned to a flash page.
+ * - \#define EVENT_LOG_PAGES     The number of flash pages reserved for the log.
+ *                       Must be enough to hold a record for every row plus 
+ *                       three pages.
+ * 
+ * @warning
+ * Changing between the log and the fixed event table changes the layout of the
+ * event table in NVM. APP_NVM_VERSION must then be incremented.
+ */
+
+/**
+ * Rebuild the RAM index from the records in flash. Must be called at power up 
+ * before the event table is accessed.
+ */
+extern void initEventLog(void);
+/**
+ * Erase the log so that every row of the event table is free.
+ */
+extern void clearEventLog(void);
+/**
+ * Read a byte of the event table.
+ * @param address the address within the event table
+ * @return the value
+ */
+extern int16_t readEventLog(uint16_t address);
+/**
+ * Read a sequence of bytes of the event table which must all be in the same row.
+ * @param address the address within the event table of the first byte
+ * @param buffer where the bytes are to be put
+ * @param length the number of bytes
+ */
+extern void readEventLogBlock(uint16_t address, uint8_t * buffer, uint8_t length);
+/**
+ * Write a byte of the event table. Changes are collected in RAM until 
+ * flushEventLog() is called or a different row is written.
+ * @param address the address within the event table
+ * @param value the value to be written
+ * @return 0 for success or error otherwise
+ */
+extern uint8_t writeEventLog(uint16_t address, uint8_t value);
+/**
+ * Append a record for any changed row and write it to flash.
+ */
+extern void flushEventLog(void);
+/**
+ * Append a record for any changed row and request that it is written to flash
+ * by pollNVM() without blocking.
+ * @param callback function called when the record is in flash, may be NULL
+ */
+extern void requestEventLogFlush(FlashFlushCallback callback);
+/**
+ * Called regularly to append a record for any changed row and to garbage
+ * collect the oldest page when the number of erased pages is low.
+ */
+extern void pollEventLog(void);
+
+#endif
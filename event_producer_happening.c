@@ -290,16 +290,16 @@ void deleteHappeningRange(Happening happening, uint8_t number) {
         if ( validStart(tableIndex)) {
             EventTableFlags f;
             Happening h;
-            f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, 
-                    EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-            h = (Happening)readNVM(EVENT_TABLE_NVM_TYPE, 
-                    EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS);
+            f.asByte = (uint8_t)EVENTTABLE_READ(
+                    EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+            h = (Happening)EVENTTABLE_READ(
+                    EVENTTABLE_EV_ADDRESS(tableIndex, 0));
             if ((h >= happening) && (h < happening+number)) {
                 writeEv(tableIndex, 0, EV_FILL);
                 checkRemoveTableEntry(tableIndex);
             }                
         }
     }
-    flushFlashBlock();
+    EVENTTABLE_FLUSH();
     rebuildHashtable();
 }
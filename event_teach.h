@@ -103,6 +103,132 @@ extern void rebuildHashtable(void);
 extern uint8_t getHash(uint16_t nodeNumber, uint16_t eventNumber);
 #endif
 
+/**
+ * The default hash of an event used by getHash(), an XOR of the bytes of the
+ * NN and EN with shifts. The length is a parameter so that host tools can
+ * compare hash table sizes.
+ *
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @param length the number of hash chains
+ * @return the hash 0..length-1
+ */
+static inline uint8_t xorEventHash(uint16_t nodeNumber, uint16_t eventNumber, uint8_t length) {
+    uint8_t hash;
+    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
+    hash = (uint8_t)(nodeNumber ^ (nodeNumber >> 8U));
+    hash = (uint8_t)(7U*hash + (eventNumber ^ (eventNumber>>8U))); 
+    // ensure it is within bounds of eventChains
+    return hash % length;
+}
+
+/**
+ * The multiplicative (Fibonacci) hash of an event used by getHash() when
+ * EVENT_HASH_MIX is defined.
+ *
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @param length the number of hash chains
+ * @return the hash 0..length-1
+ */
+static inline uint8_t mixEventHash(uint16_t nodeNumber, uint16_t eventNumber, uint8_t length) {
+    uint16_t x;
+    x = (uint16_t)(nodeNumber * 0x9E37U) ^ eventNumber;
+    x = (uint16_t)(x * 0x9E37U);
+    // scale the top byte into the range of eventChains rather than using %
+    return (uint8_t)(((uint16_t)(uint8_t)(x >> 8U) * length) >> 8U);
+}
+
+/**
+ * Lookup of bit masks so that we don't need a variable shift.
+ * Defined by the Event Teach implementation.
+ */
+extern const uint8_t teachBitMask[8];
+
+#ifdef EVENT_BLOOM_BITS
+#ifndef EVENT_HASH_TABLE
+#error "EVENT_BLOOM_BITS requires EVENT_HASH_TABLE"
+#endif
+#if (EVENT_BLOOM_BITS < 8) || (EVENT_BLOOM_BITS > 256) || (EVENT_BLOOM_BITS & (EVENT_BLOOM_BITS-1))
+#error "EVENT_BLOOM_BITS must be a power of 2 between 8 and 256"
+#endif
+/**
+ * Bloom filter bits for all the events in the event table.
+ * Defined by the Event Teach implementation.
+ */
+extern uint8_t eventBloom[EVENT_BLOOM_BITS/8];
+
+/**
+ * Obtain the first Bloom filter bit number for the specified Event.
+ * Only uses byte XORs and constant shifts so is quick on the PIC.
+ *
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @return the bit number 0..EVENT_BLOOM_BITS-1
+ */
+static inline uint8_t bloomHash1(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t b;
+    b = (uint8_t)eventNumber ^ (uint8_t)((eventNumber >> 8) << 3);
+    b ^= (uint8_t)(nodeNumber >> 8) ^ (uint8_t)(nodeNumber << 1);
+    return b & (EVENT_BLOOM_BITS-1);
+}
+
+/**
+ * Obtain the second Bloom filter bit number for the specified Event.
+ * This uses nibble swapped bytes so that it is independent of bloomHash1().
+ *
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @return the bit number 0..EVENT_BLOOM_BITS-1
+ */
+static inline uint8_t bloomHash2(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t lo = (uint8_t)eventNumber;
+    uint8_t hi = (uint8_t)(nodeNumber >> 8);
+    uint8_t b;
+    b = (uint8_t)((lo << 4) | (lo >> 4)) ^ (uint8_t)(eventNumber >> 8);
+    b ^= (uint8_t)((hi << 4) | (hi >> 4)) ^ (uint8_t)(nodeNumber << 2);
+    return b & (EVENT_BLOOM_BITS-1);
+}
+
+/**
+ * Clear the Bloom filter before it is rebuilt.
+ */
+static inline void bloomClear(void) {
+    uint8_t i;
+    for (i=0; i<EVENT_BLOOM_BITS/8; i++) {
+        eventBloom[i] = 0;
+    }
+}
+
+/**
+ * Add an event to the Bloom filter.
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ */
+static inline void bloomAdd(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t b;
+    b = bloomHash1(nodeNumber, eventNumber);
+    eventBloom[b>>3] |= teachBitMask[b&7];
+    b = bloomHash2(nodeNumber, eventNumber);
+    eventBloom[b>>3] |= teachBitMask[b&7];
+}
+
+/**
+ * Test whether an event may be in the event table.
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @return FALSE if the event is definitely not in the event table
+ */
+static inline Boolean bloomMayContain(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t b;
+    b = bloomHash1(nodeNumber, eventNumber);
+    if ( ! (eventBloom[b>>3] & teachBitMask[b&7])) return FALSE;
+    b = bloomHash2(nodeNumber, eventNumber);
+    if ( ! (eventBloom[b>>3] & teachBitMask[b&7])) return FALSE;
+    return TRUE;
+}
+#endif
+
 /**
  * A structure to store the details of an event.
  * Contains the Node Number and the Event Number.
@@ -157,7 +283,6 @@ typedef struct {
 /** Mask used to determine whether an opcode is a Short event.*/
 #define     EVENT_SHORT_MASK 0b00001000
 
-#define NUM_TEACH_DIAGNOSTICS 1      ///< The number of diagnostic values associated with this service
 #define TEACH_DIAG_COUNT              0x00 ///< Number of diagnostics
 #define TEACH_DIAG_NUM_TEACH          0x01 ///< Number of teaches counter
 
@@ -83,6 +83,14 @@
  * #define EVENT_HASH_LENGTH  // Required if EVENT_HASH_TABLE is defined and defines the length of the hash table.
  * 
  * #define EVENT_CHAIN_LENGTH // Required if EVENT_HASH_TABLE is defined and defines the length of the hash chain.
+ * 
+ * #define EVENT_BLOOM_BITS   // Optional, requires EVENT_HASH_TABLE. Size of a Bloom filter (power of 2, maximum 256)
+ *                            // used to reject events which have not been taught without reading the event table.
+ * 
+ * #define EVENT_HASH_OVERFLOW // Optional, requires EVENT_HASH_TABLE. Number of events held in an overflow area
+ *                             // when their hash chain is full. Other events are found by searching the event table.
+ * 
+ * #define EVENT_HASH_MIX     // Optional. Use a multiplicative hash giving a better spread for regular NN/EN patterns.
  *
  * @warning
  * BEWARE must set NUM_EVENTS to a maximum of 255!
@@ -155,6 +163,7 @@ extern uint8_t APP_addIndexedEvent(uint8_t enNum, uint8_t nnh, uint8_t nnl, uint
 
 #ifdef VLCB_DIAG
 static DiagnosticVal * teachGetDiagnostic(uint8_t code);
+#define NUM_TEACH_DIAGNOSTICS 1      ///< The number of diagnostic values associated with this service
 /**
  * The diagnostic values supported by the MNS service.
  */
@@ -166,9 +175,33 @@ uint8_t errno;
 
 #ifdef EVENT_HASH_TABLE
 uint8_t eventChains[EVENT_HASH_LENGTH][EVENT_CHAIN_LENGTH];
+#ifdef EVENT_BLOOM_BITS
+uint8_t eventBloom[EVENT_BLOOM_BITS/8];
+/**
+ * Lookup of bit masks so that we don't need a variable shift.
+ */
+const uint8_t teachBitMask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+#endif
+#ifdef EVENT_HASH_OVERFLOW
+/**
+ * Events whose hash chain is full.
+ */
+static uint8_t eventOverflow[EVENT_HASH_OVERFLOW];
 #endif
+/**
+ * Set if an event could not be added to the hash table so findEvent() must
+ * search the event table for events not in the hash table.
+ */
+static Boolean hashIncomplete;
+#else
+#ifdef EVENT_HASH_OVERFLOW
+#error "EVENT_HASH_OVERFLOW requires EVENT_HASH_TABLE"
+#endif
+#endif
+static uint8_t scanForEvent(uint16_t nodeNumber, uint16_t eventNumber);
 
 static uint8_t timedResponseOpcode; // used to differentiate a timed response for reqev AND reval
+static uint8_t nerdIndex;           // the next row to be checked by the NERD response
 
 /*
  * Each row in the event table consists of:
@@ -420,13 +453,12 @@ static DiagnosticVal * teachGetDiagnostic(uint8_t index) {
 
 /**
  * Removes all events including default events.
+ * The whole table is zeroed at once rather than removing each entry so that
+ * each flash page is written once.
  */
 void clearAllEvents(void) {
-    uint8_t tableIndex;
-
-    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-        removeTableEntry(tableIndex);
-    }
+    fillNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS, 0x00, (uint24_t)EVENTTABLE_WIDTH*NUM_EVENTS);
+    flushNVM(EVENT_TABLE_NVM_TYPE);
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -456,6 +488,7 @@ static void doNnevn(void) {
  * This sets things up so that timedResponse will do the right stuff.
  */
 static void doNerd(void) {
+    nerdIndex = 0;
     startTimedResponse(TIMED_RESPONSE_NERD, findServiceIndex(SERVICE_ID_INDEXED_TEACH), nerdCallback);
 }
 
@@ -468,16 +501,15 @@ static void doNerd(void) {
  */
 TimedResponseResult nerdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step){
     Word nodeNumber, eventNumber;
-    // The step is used to index through the event table
-    if (step >= NUM_EVENTS) {  // finished?
-        return TIMED_RESPONSE_RESULT_FINISHED;
-    }
-
-    eventNumber.word = getEN(step);
-    if (eventNumber.word != 0) {
-        nodeNumber.word = getNN(step);
-        sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(step));
-    }
+    // Skip over unused rows so that an event is sent at every step
+    do {
+        if (nerdIndex >= NUM_EVENTS) {  // finished?
+            return TIMED_RESPONSE_RESULT_FINISHED;
+        }
+        eventNumber.word = getEN(nerdIndex++);
+    } while (eventNumber.word == 0);
+    nodeNumber.word = getNN(nerdIndex-1);
+    sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(nerdIndex-1));
 
     return TIMED_RESPONSE_RESULT_NEXT;
 }
@@ -759,7 +791,7 @@ static uint8_t removeTableEntry(uint8_t tableIndex) {
     for (i=0; i<PARAM_NUM_EV_EVENT; i++) {
         writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + (EVENTTABLE_OFFSET_EVS + i), 0x00);
     }
-    flushFlashBlock();
+    flushNVM(EVENT_TABLE_NVM_TYPE);
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -813,7 +845,7 @@ uint8_t addIndexedEvent(uint8_t tableIndex, uint8_t nnh, uint8_t nnl, uint8_t en
         }
     }
     // success
-    flushFlashBlock();
+    flushNVM(EVENT_TABLE_NVM_TYPE);
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -829,19 +861,52 @@ uint8_t addIndexedEvent(uint8_t tableIndex, uint8_t nnh, uint8_t nnl, uint8_t en
  */
 uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
 #ifdef EVENT_HASH_TABLE
-    uint8_t hash = getHash(nodeNumber, eventNumber);
+    uint8_t hash;
     uint8_t chainIdx;
+#ifdef EVENT_BLOOM_BITS
+    // quick reject of events we have not been taught
+    if ( ! bloomMayContain(nodeNumber, eventNumber)) return NO_INDEX;
+#endif
+    hash = getHash(nodeNumber, eventNumber);
     for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
         uint8_t tableIndex = eventChains[hash][chainIdx];
         uint16_t nn, en;
-        if (tableIndex == NO_INDEX) return NO_INDEX;
+        if (tableIndex == NO_INDEX) break;
         nn = getNN(tableIndex);
         en = getEN(tableIndex);
         if ((nn == nodeNumber) && (en == eventNumber)) {
             return tableIndex;
         }
     }
+#ifdef EVENT_HASH_OVERFLOW
+    if (chainIdx == EVENT_CHAIN_LENGTH) {
+        // the chain is full so the event may be in the overflow area
+        for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+            uint8_t tableIndex = eventOverflow[chainIdx];
+            if (tableIndex == NO_INDEX) break;
+            if ((getNN(tableIndex) == nodeNumber) && (getEN(tableIndex) == eventNumber)) {
+                return tableIndex;
+            }
+        }
+    }
+#endif
+    if (hashIncomplete) {
+        return scanForEvent(nodeNumber, eventNumber);
+    }
+    return NO_INDEX;
 #else
+    return scanForEvent(nodeNumber, eventNumber);
+#endif
+}
+
+/**
+ * Find an event by searching the event table.
+ * 
+ * @param nodeNumber event NN
+ * @param eventNumber event EN
+ * @return index into event table or NO_INDEX if not present
+ */
+static uint8_t scanForEvent(uint16_t nodeNumber, uint16_t eventNumber) {
     uint8_t tableIndex;
     for (tableIndex=0; tableIndex < NUM_EVENTS; tableIndex++) {
         uint16_t b = getEN(tableIndex);
@@ -852,7 +917,6 @@ uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
             }
         }
     }
-#endif
     return NO_INDEX;
 }
 
@@ -1009,20 +1073,22 @@ static uint8_t tableIndexToEvtIdx(uint8_t tableIndex) {
  * This also means that for layouts using the default FLiM node numbers from 256, 
  * we are effectively starting from zero as far as the hash algorithm is concerned.
  * 
+ * If EVENT_HASH_MIX is defined a multiplicative (Fibonacci) hash is used instead
+ * so that every bit of the NN and EN affects the hash.
+ * 
  * @param e the event
  * @return the hash
  */
 uint8_t getHash(uint16_t nn, uint16_t en) {
-    uint8_t hash;
-    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
-    hash = (uint8_t)(nn ^ (nn >> 8U));
-    hash = (uint8_t)(7U*hash + (en ^ (en>>8U))); 
-    // ensure it is within bounds of eventChains
-    hash %= EVENT_HASH_LENGTH;
-    return hash;
+#ifdef EVENT_HASH_MIX
+    return mixEventHash(nn, en, EVENT_HASH_LENGTH);
+#else
+    return xorEventHash(nn, en, EVENT_HASH_LENGTH);
+#endif
 }
 
 
+
 /**
  * Initialise the RAM hash chain for reverse lookup of event to tableIndex.
  */
@@ -1031,20 +1097,35 @@ void rebuildHashtable(void) {
     uint8_t hash;
     uint8_t chainIdx;
     uint8_t tableIndex;
+    uint16_t nodeNumber, eventNumber;
     int a;
 
+#ifdef EVENT_BLOOM_BITS
+    bloomClear();
+#endif
     for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
         for (chainIdx=0; chainIdx < EVENT_CHAIN_LENGTH; chainIdx++) {
             eventChains[hash][chainIdx] = NO_INDEX;
         }
     }
+#ifdef EVENT_HASH_OVERFLOW
+    for (chainIdx=0; chainIdx < EVENT_HASH_OVERFLOW; chainIdx++) {
+        eventOverflow[chainIdx] = NO_INDEX;
+    }
+#endif
+    hashIncomplete = FALSE;
     // now scan the event2Action table and populate the hash and lookup tables
     for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-        if (getEN(tableIndex) != 0) {
+        eventNumber = getEN(tableIndex);
+        if (eventNumber != 0) {
             int16_t ev;
     
             // found the start of an event definition
-            hash = getHash(getNN(tableIndex), getEN(tableIndex));            
+            nodeNumber = getNN(tableIndex);
+#ifdef EVENT_BLOOM_BITS
+            bloomAdd(nodeNumber, eventNumber);
+#endif
+            hash = getHash(nodeNumber, eventNumber);
             for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
                 if (eventChains[hash][chainIdx] == NO_INDEX) {
                     // available
@@ -1052,6 +1133,22 @@ void rebuildHashtable(void) {
                     break;
                 }
             }
+            if (chainIdx == EVENT_CHAIN_LENGTH) {
+#ifdef EVENT_HASH_OVERFLOW
+                // chain is full so use the overflow area
+                for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+                    if (eventOverflow[chainIdx] == NO_INDEX) {
+                        eventOverflow[chainIdx] = tableIndex;
+                        break;
+                    }
+                }
+                if (chainIdx == EVENT_HASH_OVERFLOW) {
+                    hashIncomplete = TRUE;
+                }
+#else
+                hashIncomplete = TRUE;
+#endif
+            }
         }
     }
 }
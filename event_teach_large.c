@@ -60,7 +60,9 @@
 #include "nvm.h"
 #include "mns.h"
 #include "timedResponse.h"
+#include "ticktime.h"
 #include "event_teach.h"
+#include "event_teach_large.h"
 #include "event_producer.h"
 #include "module.h"
 
@@ -77,8 +79,8 @@
  * address of the whole event table can also be covered by a 16 bit address, there is no
  * advantage in having a separate hashed index table pointing to the actual event table.
  * Therefore the hashing algorithm produces the index into the actual event table, which
- * can be shifted to give the address - each event table entry is 16 bytes. After the event
- * number and hash table overhead, this allows up to 10 EVs per event.
+ * can be shifted to give the address - each event table entry is EVENTTABLE_ROW_WIDTH
+ * bytes, a power of 2 which defaults to 16. See event_teach_large.h.
  *
  * This generic code needs no knowledge of specific EV usage.
  *
@@ -96,7 +98,8 @@
  * # Module.h definitions required for the Event Teach service
  * - \#define EVENT_TABLE_WIDTH   This the the width of the table - not the
  *                       number of EVs per event as multiple rows in
- *                       the table can be used to store an event.
+ *                       the table can be used to store an event. Optional,
+ *                       if not defined it is derived from PARAM_NUM_EV_EVENT.
  * - \#define NUM_EVENTS          The number of rows in the event table. The
  *                        actual number of events may be less than this
  *                        if any events use more the 1 row.
@@ -108,7 +111,60 @@
  *                        of the hash.
  * - \#define EVENT_CHAIN_LENGTH    If hash tables are used then this sets the number
  *                        of events in the hash chain.
+ * - \#define EVENT_BLOOM_BITS      Optional, requires EVENT_HASH_TABLE. If defined then
+ *                        a Bloom filter of this many bits (a power of 2, maximum
+ *                        256) is used to reject events which have not been taught
+ *                        without any access to the event table.
+ * - \#define EVENT_HASH_OVERFLOW   Optional, requires EVENT_HASH_TABLE. The number
+ *                        of events which can be held in an overflow area when
+ *                        their hash chain is full. Events which do not fit in
+ *                        the overflow area are still found by searching the 
+ *                        event table.
+ * - \#define EVENT_HASH_MIX        Optional. Use a multiplicative hash which gives a
+ *                        better spread for regular patterns of NN and EN.
+ *
+ * # Sizing the hash table
+ * With VLCB_DIAG defined the quality of the hash table can be checked on a 
+ * module loaded with a typical set of events by reading the diagnostics with RDGN.
+ * - If TEACH_DIAG_OVERFLOWED is not zero then some events are not in their hash
+ *   chain. Increase EVENT_CHAIN_LENGTH to at least TEACH_DIAG_LONGEST_CHAIN or 
+ *   increase EVENT_HASH_LENGTH.
+ * - TEACH_DIAG_LOOKUP_ROWS divided by TEACH_DIAG_LOOKUPS is the average number of
+ *   rows read per event received. Where this is much more than 1 and 
+ *   TEACH_DIAG_EMPTY_CHAINS is a large part of EVENT_HASH_LENGTH the events are
+ *   poorly spread so try EVENT_HASH_MIX.
+ * - If TEACH_DIAG_EMPTY_CHAINS is a large part of EVENT_HASH_LENGTH and the 
+ *   average is close to 1 then EVENT_HASH_LENGTH can be reduced to save RAM.
+ * - TEACH_DIAG_REBUILD_TIME shows how long the module is busy after each change
+ *   to the event table outside of a learn session.
+ * 
+ * The same sizing can be done before building the module with the hashreport
+ * program in the host directory, which runs this code on the host with an 
+ * image of the event table, or a synthetic set of events, and reports these
+ * diagnostics together with the NVM reads per findEvent().
+ * 
  * - \#define MAX_HAPPENING         Set to be the maximum Happening value
+ * - \#define LEARN_SESSION_TIMEOUT Optional. The idle time after which a learn
+ *                        session is ended, defaults to TWO_SECOND.
+ * - \#define EVENT_LEARN_BATCH     Optional. Acknowledge EVLRN/EVULN before the
+ *                        change is stored and commit the changes once at the
+ *                        end of the learn session, see Learn sessions.
+ * - \#define EVENT_COMPACT_INTERVAL Optional. The time between each step of the
+ *                        background compaction, defaults to TEN_MILI_SECOND.
+ * - \#define EVENT_EV_CACHE        Optional. The number of events whose EVs are held
+ *                        in a RAM cache so that getEv() does not need to read
+ *                        the event table. Each entry uses PARAM_NUM_EV_EVENT+2
+ *                        bytes of RAM. The least recently used entry is replaced
+ *                        and the cache is cleared whenever the table is changed.
+ * - \#define EVENT_LOOKUP_CACHE    Optional. The number of recent findEvent() results,
+ *                        including events which were not found, held in a RAM
+ *                        cache. Each entry uses 5 bytes of RAM. A small cache of
+ *                        8 to 16 entries lets the most frequently received events
+ *                        be found without reading the event table.
+ * - \#define EVENT_RANGES          Optional. The number of range entries, each of 
+ *                        which matches a contiguous block of ENs with a single
+ *                        set of EVs. Also requires EVENT_RANGE_ADDRESS, see
+ *                        event_teach_large.h and addEventRange().
  *
  * The code is responsible for storing EVs for each defined event and 
  * also for allowing speedy lookup of EVs given an Event or finding an Event given 
@@ -159,7 +215,9 @@
  * The 'eVsUsed' field records how many of the evs contain valid data. 
  * It is only applicable for the last entry in the chain since all EVs less than 
  * this are assumed to contain valid data. Since this field is only 4 bits long 
- * this places a limit on the EVENT_TABLE_WIDTH of 15.
+ * it can only be used if EVENT_TABLE_WIDTH is 15 or less. For wider rows
+ * EVENTTABLE_EXTENDED_EVSUSED is defined and an extra header byte holds the
+ * number of EVs used instead.
  * 
  * EXAMPLE
  * Let's go through an example of filling in the table. We'll look at the first 
@@ -218,7 +276,50 @@
  * eventtable and the eventtable's event field is checked to see if it matches the
  * received event. It it does match then the index into eventtable has been found 
  * and is returned. The EVs can then be accessed from the ev[] field.
+ *
+ * Most events seen on the bus are not ones that this module has been taught.
+ * If EVENT_BLOOM_BITS is defined then a small Bloom filter held in RAM is also
+ * populated by rebuildHashtable(). Each taught event sets two bits, selected by
+ * bloomHash1() and bloomHash2() in event_teach.h. findEvent() checks these two
+ * bits first and if either is clear then the event cannot be in the EventTable and NO_INDEX is
+ * returned without reading the EventTable at all. False positives simply fall
+ * through to the normal hash chain search.
+ *
+ * Learn sessions
+ * Teaching an event with EVLRN starts a learn session. Whilst the session is
+ * in progress the RAM hash table is updated incrementally as events are added
+ * and removed rather than being rebuilt from the EventTable. The session ends
+ * when learn mode is left (NNULN, MODE or NNLRN to another module) or when no
+ * EVLRN/EVULN has been received for LEARN_SESSION_TIMEOUT, and the hash tables
+ * are then rebuilt. 
+ * 
+ * By default WRACK means that the change has been stored: after each EVLRN or
+ * EVULN a non-blocking flush is requested and the WRACK, and any GRSP, is sent
+ * by the flush's callback once the change is in NVM. Each change therefore 
+ * still costs a flash page write. 
  * 
+ * If EVENT_LEARN_BATCH is defined the WRACK is sent straight away and the 
+ * changes are left in the flash buffer until the end of the session, so that
+ * a bulk teach writes each page once and is limited by the bus rather than 
+ * by flash. Changes acknowledged during the session are lost if power fails
+ * before it ends, up to LEARN_SESSION_TIMEOUT after the last EVLRN/EVULN.
+ *
+ * Compaction
+ * Continuation rows are allocated from the first free row after the previous 
+ * row in the chain, which after events have been removed and added may be a long 
+ * way away. When the module is idle (not in learn mode, no learn session and no
+ * timed response in progress) teachPoll() examines one row every 
+ * EVENT_COMPACT_INTERVAL. If the row is continued in a row further away than the
+ * nearest free row then the continuation row is copied into that free row, the
+ * 'next' field updated and the old row freed. The number of continuation rows 
+ * which are not immediately after the previous row of their chain, as found by
+ * the last full pass, is available as diagnostic TEACH_DIAG_FRAGMENTED.
+ * The copy is flushed before the chain is relinked, and the relink before the
+ * old row is freed, so a power failure part way through can only leave a 
+ * continuation row which no chain reaches. Each step is started from the flush 
+ * callback of the previous one so teachPoll() never waits for flash; any change
+ * to the table first completes a relocation in progress. These orphaned rows are freed at 
+ * power up by freeOrphanRows().
  */
 
 
@@ -228,6 +329,20 @@ static void teachPowerUp(void);
 static Processed teachProcessMessage(Message * m);
 static uint8_t teachGetESDdata(uint8_t id);
 static void clearAllEvents(void);
+static void teachPoll(void);
+static void startLearnSession(void);
+#ifndef EVENT_TABLE_LOG
+static void compactStep(void);
+static void compactFlushed(void);
+static void finishCompaction(void);
+#endif
+static uint8_t getEvsUsed(uint8_t tableIndex, EventTableFlags f);
+static void setEvsUsed(uint8_t tableIndex, EventTableFlags f, uint8_t num);
+static void endLearnSession(void);
+static void loadRowsInUse(void);
+static void freeOrphanRows(void);
+static uint8_t findFreeRow(uint8_t tableIndex);
+static uint8_t findValidStart(uint8_t tableIndex);
 Processed checkLen(Message * m, uint8_t needed, uint8_t service);
 static Processed teachCheckLen(Message * m, uint8_t needed, uint8_t learn);
 static uint8_t evtIdxToTableIndex(uint8_t evtIdx);
@@ -240,6 +355,7 @@ uint8_t numEv(uint8_t tableIndex);
 int16_t getEv(uint8_t tableIndex, uint8_t evNum);
 static uint8_t tableIndexToEvtIdx(uint8_t tableIndex);
 uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber);
+static uint8_t lookupEvent(uint16_t nodeNumber, uint16_t eventNumber);
 static uint8_t removeTableEntry(uint8_t tableIndex);
 uint8_t removeEvent(uint16_t nodeNumber, uint16_t eventNumber);
 void checkRemoveTableEntry(uint8_t tableIndex);
@@ -253,48 +369,6 @@ static void doEvuln(uint16_t nodeNumber, uint16_t eventNumber);
 static void doReqev(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum);
 static void doEvlrn(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8_t evVal);
 
-/**
- * The flags containing information about the event table entry.
- * A union provides access as bits or as a complete byte.
- */
-typedef union
-{
-    struct
-    {
-        uint8_t    eVsUsed:4;  ///< How many of the EVs in this row are used. Only valid if continued is clear.
-        uint8_t    continued:1;    ///< there is another entry.
-        uint8_t    continuation:1; ///< Continuation of previous event entry.
-        uint8_t    forceOwnNN:1;   ///< Ignore the specified NN and use module's own NN.
-        uint8_t    freeEntry:1;    ///< this row in the table is not used - takes priority over other flags.
-    };
-    uint8_t    asByte;       ///< Set to 0xFF for free entry, initially set to zero for entry in use, then producer flag set if required.
-} EventTableFlags;
-
-/**
- * Defines a row within the Event table.
- * Each row consists of 1 byte of flags, an index into the table for the next
- * row if this event is spread over multiple rows, the event and the events EVs.
- */
-typedef struct {
-    EventTableFlags flags;          ///< put first so could potentially use the Event bytes for EVs in subsequent rows.
-    uint8_t next;                   ///< index to continuation also indicates if entry is free.
-    Event event;                    ///< the NN and EN.
-    uint8_t evs[EVENT_TABLE_WIDTH]; ///< EVENT_TABLE_WIDTH is maximum of 15 as we have 4 bits of maxEvUsed.
-} EventTable;
-
-/** Byte index into an EventTable row to access the flags element.*/
-#define EVENTTABLE_OFFSET_FLAGS    0
-/** Byte index into an EventTable row to access the next element.*/
-#define EVENTTABLE_OFFSET_NEXT     1
-/** Byte index into an EventTable row to access the event nn element.*/
-#define EVENTTABLE_OFFSET_NN       2
-/** Byte index into an EventTable row to access the event en element.*/
-#define EVENTTABLE_OFFSET_EN       4
-/** Byte index into an EventTable row to access the event variables.*/
-#define EVENTTABLE_OFFSET_EVS      6
-/** Total number of bytes in an EventTable row.*/
-#define EVENTTABLE_ROW_WIDTH       16
-
 /** Represents an invalid index into the EventTable.*/
 #define NO_INDEX            0xff
 
@@ -318,7 +392,7 @@ const Service eventTeachService = {
     teachFactoryReset,  // factoryReset
     teachPowerUp,       // powerUp
     teachProcessMessage,// processMessage
-    NULL,               // poll
+    teachPoll,          // poll
 #if defined(_18F66K80_FAMILY_)
     NULL,               // highIsr
     NULL,               // lowIsr
@@ -339,9 +413,172 @@ uint8_t eventChains[EVENT_HASH_LENGTH][EVENT_CHAIN_LENGTH];
 #ifdef EVENT_PRODUCED_EVENT_HASH
 uint8_t happening2Event[2+MAX_HAPPENING-HAPPENING_BASE];
 #endif
+#ifdef EVENT_BLOOM_BITS
+uint8_t eventBloom[EVENT_BLOOM_BITS/8];
+#endif
+#ifdef EVENT_HASH_OVERFLOW
+/**
+ * Events whose hash chain is full.
+ */
+static uint8_t eventOverflow[EVENT_HASH_OVERFLOW];
+static void removeFromOverflow(uint8_t overflowIdx);
+#endif
+/**
+ * Set if an event could not be added to the hash table so findEvent() must
+ * search the event table for events not in the hash table.
+ */
+static Boolean hashIncomplete;
+#ifdef VLCB_DIAG
+static TickValue rebuildStart;
+#endif
+static void insertHash(uint8_t tableIndex, uint8_t hash);
+static void addToHashtable(uint8_t tableIndex);
+static void removeFromHashtable(uint8_t tableIndex);
+#else
+#ifdef EVENT_HASH_OVERFLOW
+#error "EVENT_HASH_OVERFLOW requires EVENT_HASH_TABLE"
 #endif
+#endif
+static uint8_t scanForEvent(uint16_t nodeNumber, uint16_t eventNumber);
 
 static uint8_t timedResponseOpcode; // used to differentiate a timed response for reqev AND reval
+static uint8_t nerdIndex;           // the next row to be checked by the NERD response
+
+#ifndef LEARN_SESSION_TIMEOUT
+#define LEARN_SESSION_TIMEOUT   TWO_SECOND
+#endif
+/**
+ * Set whilst a learn session is in progress and the flash buffer flush and 
+ * hash table rebuild are being deferred.
+ */
+static Boolean learnSession;
+/**
+ * Time of the last change to the event table during a learn session.
+ */
+static TickValue learnSessionTime;
+/*
+ * The number of EVLRN and EVULN whose WRACK is waiting for the change to be
+ * written to NVM.
+ */
+static uint8_t evlrnAcks;
+static uint8_t evulnAcks;
+static void sendTeachAcks(void);
+
+#ifndef EVENT_COMPACT_INTERVAL
+#define EVENT_COMPACT_INTERVAL  TEN_MILI_SECOND
+#endif
+static uint8_t compactIndex;        // the next row to be checked by compaction
+static uint8_t fragmentedRows;      // fragmented rows found so far in this pass
+static TickValue compactTime;
+static enum {
+    COMPACT_IDLE,       // looking for a row to move
+    COMPACT_COPY,       // waiting for the copy of the continuation row to be written
+    COMPACT_LINK,       // waiting for the chain to be linked to the copy
+    COMPACT_FREE        // waiting for the old row to be freed
+} compactState;
+static uint8_t compactFrom;         // the row whose continuation is being moved
+static uint8_t compactOld;          // the continuation row being moved
+static uint8_t compactNew;          // the free row it is being moved to
+
+/**
+ * Lookup of bit masks so that we don't need a variable shift.
+ */
+const uint8_t teachBitMask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+
+#ifdef EVENT_LOOKUP_CACHE
+/**
+ * A cached result of findEvent().
+ */
+typedef struct {
+    uint16_t nodeNumber;    ///< the event's NN
+    uint16_t eventNumber;   ///< the event's EN
+    uint8_t tableIndex;     ///< the start of the event or NO_INDEX if not taught
+} LookupCacheEntry;
+/**
+ * The cached lookups ordered from most to least recently used.
+ */
+static LookupCacheEntry lookupCache[EVENT_LOOKUP_CACHE];
+static uint8_t lookupCacheUsed;     ///< the number of valid entries in lookupCache
+#endif
+
+#ifdef EVENT_EV_CACHE
+/**
+ * A cached copy of the EVs of an event.
+ */
+typedef struct {
+    uint8_t tableIndex;                 ///< the start of the event or NO_INDEX if unused
+    uint8_t numEvs;                     ///< the EVs beyond this are not present
+    uint8_t evs[PARAM_NUM_EV_EVENT];    ///< the EV values
+} EvCacheEntry;
+static EvCacheEntry evCache[EVENT_EV_CACHE];
+/**
+ * The indices of the evCache entries ordered from most to least recently used.
+ */
+static uint8_t evCacheOrder[EVENT_EV_CACHE];
+static uint8_t getEvCache(uint8_t tableIndex);
+static void clearEvCache(void);
+#endif
+
+#ifdef EVENT_RANGES
+/**
+ * RAM copy of the NN and ENs of each range entry so that a range can be matched
+ * without reading NVM. A free range entry has first greater than last.
+ */
+typedef struct {
+    uint16_t nodeNumber;    ///< the NN of the range
+    uint16_t first;         ///< the first EN of the range
+    uint16_t last;          ///< the last EN of the range
+} EventRange;
+static EventRange eventRanges[EVENT_RANGES];
+/**
+ * A range handle identifies an event within a range other than the first. The
+ * index EVENTRANGE_HANDLE_INDEX(h) returned by findEvent() carries the range
+ * and the position of the EN within it so getEv(), getEN() etc. need no other
+ * state. Handles are reused round robin so an index remains valid until 
+ * EVENT_RANGE_HANDLES other range events have been found.
+ */
+typedef struct {
+    uint8_t range;          ///< the range entry or NO_RANGE if the handle is unused
+    uint8_t offset;         ///< the position of the EN within the range
+} RangeHandle;
+static RangeHandle rangeHandles[EVENT_RANGE_HANDLES];
+static uint8_t nextRangeHandle;     // the next handle to be reused
+static uint8_t reqevHandle;         // the handle in use by reqevCallback(), which is not reused
+static uint8_t nerdRange;           // the next range entry to be sent by the NERD response
+static uint8_t nerdRangeOffset;     // the position within nerdRange of the next event to be sent
+static void loadEventRanges(void);
+static void clearEventRanges(void);
+static void freeRangeHandles(uint8_t range);
+static uint8_t findEventRange(uint16_t nodeNumber, uint16_t eventNumber);
+static uint8_t indexToRange(uint8_t tableIndex, uint8_t * offset);
+static Boolean validRange(uint8_t tableIndex);
+static int16_t getRangeEv(uint8_t range, uint8_t offset, uint8_t evNum);
+static uint8_t writeRangeEv(uint8_t range, uint8_t evNum, uint8_t evVal);
+static uint8_t removeEventRange(uint8_t range);
+static TimedResponseResult nerdRangeCallback(void);
+/** Marks an unused range handle.*/
+#define NO_RANGE            0xff
+#endif
+
+/**
+ * Occupancy bitmap of the event table with one bit per row. A set bit indicates 
+ * that the row is in use, either as the start of an event or as a continuation.
+ * This is built from the row flags at power up and then maintained as rows are
+ * allocated and freed so that free rows can be found without reading the table.
+ */
+static uint8_t rowsInUse[(NUM_EVENTS+7)/8];
+/** Test whether a row is in use.*/
+#define ROW_IN_USE(i)       (rowsInUse[(i)>>3] & teachBitMask[(i)&7])
+
+/*
+ * Running counts of the free rows and of the events in the table. These are 
+ * calculated at power up and then maintained as rows are allocated and freed
+ * so that NUMEV and EVNLF can be answered without reading the table.
+ */
+static uint8_t numFreeRows;
+static uint8_t numValidEvents;
+static void setRowInUse(uint8_t tableIndex);
+static void setRowFree(uint8_t tableIndex);
 
 //
 // SERVICE FUNCTIONS
@@ -359,17 +596,69 @@ static void teachFactoryReset(void) {
  */
 static void teachPowerUp(void) {
     uint8_t i;
-#ifdef EVENT_HASH_TABLE
-    rebuildHashtable();
-#endif
 #ifdef VLCB_DIAG
     // Clear the diagnostics
     for (i=1; i<= NUM_TEACH_DIAGNOSTICS; i++) {
         teachDiagnostics[i].asUint = 0;
     }
     teachDiagnostics[TEACH_DIAG_COUNT].asUint = NUM_TEACH_DIAGNOSTICS;
+#endif
+#ifdef EVENT_TABLE_LOG
+    initEventLog();
+#endif
+#ifdef EVENT_LOOKUP_CACHE
+    lookupCacheUsed = 0;
+#endif
+#ifdef EVENT_EV_CACHE
+    clearEvCache();
+#endif
+    loadRowsInUse();
+    freeOrphanRows();
+#ifdef EVENT_RANGES
+    loadEventRanges();
+#endif
+#ifdef EVENT_HASH_TABLE
+    rebuildHashtable();
 #endif
     mode_flags &= ~FLAG_MODE_LEARN; // revert to learn OFF on power up
+    learnSession = FALSE;
+    evlrnAcks = 0;
+    evulnAcks = 0;
+    compactIndex = 0;
+    fragmentedRows = 0;
+    compactState = COMPACT_IDLE;
+    compactTime.val = tickGet();
+}
+
+/**
+ * Called regularly to end a learn session once learn mode has been left or 
+ * no further teaching has been received for LEARN_SESSION_TIMEOUT.
+ */
+static void teachPoll(void) {
+    if (learnSession) {
+        if ((! (mode_flags & FLAG_MODE_LEARN)) || 
+                (tickTimeSince(learnSessionTime) > LEARN_SESSION_TIMEOUT)) {
+            endLearnSession();
+        }
+        return;
+    }
+    // Only compact the table when nothing else is going on
+    if (mode_flags & FLAG_MODE_LEARN) return;
+    if (timedResponseInProgress()) return;
+#ifdef EVENT_TABLE_LOG
+    // rows do not have a fixed location in the log so there is nothing to compact
+    pollEventLog();
+#else
+    if (compactState != COMPACT_IDLE) {
+        // a relocation is waiting for its flush callback
+        if (tickTimeSince(compactTime) > ONE_SECOND) {
+            finishCompaction();
+        }
+    } else if (tickTimeSince(compactTime) > EVENT_COMPACT_INTERVAL) {
+        compactTime.val = tickGet();
+        compactStep();
+    }
+#endif
 }
 
 /**
@@ -548,32 +837,197 @@ static DiagnosticVal * teachGetDiagnostic(uint8_t index) {
  */
 static void clearAllEvents(void) {
     uint8_t tableIndex;
-    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-        // set the free flag
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex + EVENTTABLE_OFFSET_FLAGS, 0xff);
+#ifdef EVENT_TABLE_LOG
+    clearEventLog();
+#else
+    finishCompaction();
+    if (EVENT_TABLE_NVM_TYPE == FLASH_NVM_TYPE) {
+        // erased rows are free so erase the pages rather than write each flag
+        fillNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS, 0xFF, EVENTTABLE_SIZE);
+    } else {
+        for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+            // set the free flag
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), 0xff);
+        }
+    }
+#endif
+    for (tableIndex=0; tableIndex<sizeof(rowsInUse); tableIndex++) {
+        rowsInUse[tableIndex] = 0;
     }
-    flushFlashBlock();
+    numFreeRows = NUM_EVENTS;
+    numValidEvents = 0;
+#ifdef EVENT_LOOKUP_CACHE
+    lookupCacheUsed = 0;
+#endif
+#ifdef EVENT_EV_CACHE
+    clearEvCache();
+#endif
+#ifdef EVENT_RANGES
+    clearEventRanges();
+#endif
+    EVENTTABLE_FLUSH();
+#ifdef EVENT_HASH_TABLE
+    rebuildHashtable();
+#endif
+}
+
+/**
+ * Start, or continue, a learn session. Whilst the session is in progress the
+ * flash buffer is not flushed and the hash table is not rebuilt after each change.
+ */
+static void startLearnSession(void) {
+#ifndef EVENT_TABLE_LOG
+    finishCompaction();
+#endif
+    learnSession = TRUE;
+    learnSessionTime.val = tickGet();
+}
+
+/**
+ * End a learn session, rebuilding the hash tables from the event table. With 
+ * EVENT_LEARN_BATCH the changes made during the session are also committed.
+ */
+static void endLearnSession(void) {
+    learnSession = FALSE;
+#ifdef EVENT_LEARN_BATCH
+    EVENTTABLE_REQUEST_FLUSH(NULL);
+#endif
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
 }
 
+/**
+ * Called when the changes made by EVLRN and EVULN have been written to NVM to
+ * send the WRACK, and GRSP, for each of them.
+ */
+static void sendTeachAcks(void) {
+    for (; evlrnAcks > 0; evlrnAcks--) {
+        sendMessage2(OPC_WRACK, nn.bytes.hi, nn.bytes.lo);
+#ifdef VLCB_GRSP
+        sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_EVLRN, SERVICE_ID_OLD_TEACH, GRSP_OK);
+#endif
+    }
+    for (; evulnAcks > 0; evulnAcks--) {
+        // Send a WRACK - difference from CBUS
+        sendMessage2(OPC_WRACK, nn.bytes.hi, nn.bytes.lo);
+#ifdef VLCB_GRSP
+        sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_EVULN, SERVICE_ID_OLD_TEACH, GRSP_OK);
+#endif
+    }
+}
+
+#ifndef EVENT_TABLE_LOG
+/**
+ * Perform one step of the background compaction of continuation chains.
+ * A single row of the event table is examined and, if it is continued in a row
+ * further away than the nearest following free row, the continuation row is 
+ * moved into that free row.
+ */
+static void compactStep(void) {
+    EventTableFlags f;
+    uint8_t tableIndex;
+    uint8_t next;
+    uint8_t freeIndex;
+    uint8_t i;
+    
+    if (compactIndex >= NUM_EVENTS) {
+        // completed a pass of the table
+#ifdef VLCB_DIAG
+        teachDiagnostics[TEACH_DIAG_FRAGMENTED].asUint = fragmentedRows;
+#endif
+        fragmentedRows = 0;
+        compactIndex = 0;
+    }
+    tableIndex = compactIndex++;
+    if ( ! ROW_IN_USE(tableIndex)) return;
+    f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+    if ( ! f.continued) return;
+    next = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
+    if (next == tableIndex+1) return;   // already next to each other
+    if (next >= NUM_EVENTS) return;     // shouldn't happen
+    fragmentedRows++;
+    freeIndex = findFreeRow(tableIndex+1);
+    if ((freeIndex == NO_INDEX) || (freeIndex > next)) return;   // nowhere closer
+    if (APP_isSuitableTimeToWriteFlash() == BAD_TIME) {
+        // try this row again later
+        compactIndex--;
+        fragmentedRows--;
+        return;
+    }
+    // copy the continuation row into the free row
+    for (i=0; i<EVENTTABLE_HEADER_WIDTH; i++) {
+        EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(freeIndex, i), 
+                (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(next, i)));
+    }
+    for (i=0; i<EVENT_TABLE_WIDTH; i++) {
+        EVENTTABLE_WRITE(EVENTTABLE_EV_ADDRESS(freeIndex, i), 
+                (uint8_t)EVENTTABLE_READ(EVENTTABLE_EV_ADDRESS(next, i)));
+    }
+    setRowInUse(freeIndex);
+    compactFrom = tableIndex;
+    compactOld = next;
+    compactNew = freeIndex;
+    compactState = COMPACT_COPY;
+    // Each step is flushed before the next so that a power failure cannot 
+    // leave the chain linked to a row which has not been written
+    EVENTTABLE_REQUEST_FLUSH(compactFlushed);
+}
+
+/**
+ * Called when the previous step of a relocation has been written to NVM to
+ * perform the next step. A callback means that everything written so far has 
+ * been stored so it is safe to move on whichever request it was made for.
+ */
+static void compactFlushed(void) {
+    switch (compactState) {
+        case COMPACT_COPY:
+            // link the copy into the chain
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(compactFrom, EVENTTABLE_OFFSET_NEXT), compactNew);
+            compactState = COMPACT_LINK;
+            EVENTTABLE_REQUEST_FLUSH(compactFlushed);
+            break;
+        case COMPACT_LINK:
+            // and free the old row
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(compactOld, EVENTTABLE_OFFSET_FLAGS), 0xff);
+            setRowFree(compactOld);
+            compactState = COMPACT_FREE;
+            EVENTTABLE_REQUEST_FLUSH(compactFlushed);
+            break;
+        case COMPACT_FREE:
+            if (compactNew == compactFrom+1) {
+                fragmentedRows--;
+            }
+#ifdef VLCB_DIAG
+            teachDiagnostics[TEACH_DIAG_RELOCATED].asUint++;
+#endif
+            compactState = COMPACT_IDLE;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Complete any relocation in progress, waiting for each step to be written.
+ * Called before the table is changed so that a change cannot be made to a row
+ * which is being moved, and as a fallback if the flush callback was replaced by
+ * another request.
+ */
+static void finishCompaction(void) {
+    while (compactState != COMPACT_IDLE) {
+        EVENTTABLE_FLUSH();
+        compactFlushed();
+    }
+}
+#endif
+
 /**
  * Read number of available event slots.
  * This returned the number of unused slots in the Consumed event Event2Action table.
  */
 static void doNnevn(void) {
-    // count the number of unused slots.
-    uint8_t count = 0;
-    uint8_t i;
-    for (i=0; i<NUM_EVENTS; i++) {
-        EventTableFlags f;
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_FLAGS);
-        if (f.freeEntry) {
-            count++;
-        }
-    }
-    sendMessage3(OPC_EVNLF, nn.bytes.hi, nn.bytes.lo, count);
+    sendMessage3(OPC_EVNLF, nn.bytes.hi, nn.bytes.lo, numFreeRows);
 } // doNnevn
 
 
@@ -582,6 +1036,11 @@ static void doNnevn(void) {
  * This sets things up so that timedResponse will do the right stuff.
  */
 static void doNerd(void) {
+    nerdIndex = 0;
+#ifdef EVENT_RANGES
+    nerdRange = 0;
+    nerdRangeOffset = 0;
+#endif
     startTimedResponse(TIMED_RESPONSE_NERD, findServiceIndex(SERVICE_ID_OLD_TEACH), nerdCallback);
 }
 
@@ -594,16 +1053,21 @@ static void doNerd(void) {
  */
 TimedResponseResult nerdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step){
     Word nodeNumber, eventNumber;
-    // The step is used to index through the event table
-    if (step >= NUM_EVENTS) {  // finished?
+    uint8_t tableIndex;
+    // Skip over free and continuation rows so that an event is sent at every step
+    tableIndex = findValidStart(nerdIndex);
+    if (tableIndex == NO_INDEX) {  // finished?
+#ifdef EVENT_RANGES
+        // then send each of the events covered by the range entries
+        return nerdRangeCallback();
+#else
         return TIMED_RESPONSE_RESULT_FINISHED;
+#endif
     }
-    // if its not free and not a continuation then it is start of an event
-    if (validStart(step)) {
-        nodeNumber.word = getNN(step);
-        eventNumber.word = getEN(step);
-        sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(step));
-    }
+    nodeNumber.word = getNN(tableIndex);
+    eventNumber.word = getEN(tableIndex);
+    sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(tableIndex));
+    nerdIndex = tableIndex+1;
     return TIMED_RESPONSE_RESULT_NEXT;
 }
 
@@ -619,7 +1083,12 @@ static void doNenrd(uint8_t index) {
     
     tableIndex = evtIdxToTableIndex(index);
     // check this is a valid index
+#ifdef EVENT_RANGES
+    // a range entry gives the first event of the range
+    if (( ! validRange(tableIndex)) && ( ! validStart(tableIndex))) {
+#else
     if ( ! validStart(tableIndex)) {
+#endif
         sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, CMDERR_INV_EN_IDX);
             // DEBUG  
 //        cbusMsg[d7] = readNVM((uint16_t)(& (EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_[tableIndex].flags.asByte))); 
@@ -638,15 +1107,23 @@ static void doNenrd(uint8_t index) {
  * in the Event table.
  */
 static void doRqevn(void) {
-    // Count the number of used slots.
-    uint8_t count = 0;
-    uint8_t i;
-    for (i=0; i<NUM_EVENTS; i++) {
-        if (validStart(i)) {
-            count++;    
+#ifdef EVENT_RANGES
+    // each event covered by a range is counted, up to the maximum of 255
+    uint16_t count = numValidEvents;
+    uint8_t r;
+    for (r=0; r<EVENT_RANGES; r++) {
+        if (eventRanges[r].first <= eventRanges[r].last) {
+            if (eventRanges[r].last - eventRanges[r].first >= 255 - count) {
+                count = 255;
+                break;
+            }
+            count += eventRanges[r].last - eventRanges[r].first + 1U;
         }
     }
-    sendMessage3(OPC_NUMEV, nn.bytes.hi, nn.bytes.lo, count);
+    sendMessage3(OPC_NUMEV, nn.bytes.hi, nn.bytes.lo, (uint8_t)count);
+#else
+    sendMessage3(OPC_NUMEV, nn.bytes.hi, nn.bytes.lo, numValidEvents);
+#endif
 } // doRqevn
 
 /**
@@ -679,6 +1156,7 @@ static void doEvlrn(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, ui
 #endif
         return;
     }
+    startLearnSession();
     // Normally this will be #defined in module.h to be addEvent() but the 
     // application may instead handle the adding of the event itself to 
     // perform any special processing and/or call addEvent() itself.
@@ -694,9 +1172,13 @@ static void doEvlrn(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, ui
 #ifdef VLCB_DIAG
     teachDiagnostics[TEACH_DIAG_NUM_TEACH].asUint++;
 #endif
-    sendMessage2(OPC_WRACK, nn.bytes.hi, nn.bytes.lo);
-#ifdef VLCB_GRSP
-    sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_EVLRN, SERVICE_ID_OLD_TEACH, GRSP_OK);
+    evlrnAcks++;
+#ifdef EVENT_LEARN_BATCH
+    // acknowledge now, the change is stored when the learn session ends
+    sendTeachAcks();
+#else
+    // acknowledge once the change has been stored
+    EVENTTABLE_REQUEST_FLUSH(sendTeachAcks);
 #endif
     return;
 }
@@ -721,8 +1203,14 @@ static void doReval(uint8_t enNum, uint8_t evNum) {
     evIndex = evNum-1U;    // Convert from CBUS numbering (starts at 1 for produced action))
     
     // check it is a valid index
+#ifdef EVENT_RANGES
+    // a range entry gives the EVs of the first event of the range
+    if ((tableIndex < NUM_EVENTS) || validRange(tableIndex)) {
+        if (validRange(tableIndex) || validStart(tableIndex)) {
+#else
     if (tableIndex < NUM_EVENTS) {
         if (validStart(tableIndex)) {
+#endif
             int evVal;
             
             if (evNum == 0) {
@@ -756,6 +1244,7 @@ static void doReval(uint8_t enNum, uint8_t evNum) {
  */
 static void doEvuln(uint16_t nodeNumber, uint16_t eventNumber) {
     uint8_t result;
+    startLearnSession();
     result = removeEvent(nodeNumber, eventNumber);
     if (result) {
         sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, result);
@@ -764,10 +1253,13 @@ static void doEvuln(uint16_t nodeNumber, uint16_t eventNumber) {
 #endif
         return;
     }
-    // Send a WRACK - difference from CBUS
-    sendMessage2(OPC_WRACK, nn.bytes.hi, nn.bytes.lo);
-#ifdef VLCB_GRSP
-    sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_EVULN, SERVICE_ID_OLD_TEACH, GRSP_OK);
+    evulnAcks++;
+#ifdef EVENT_LEARN_BATCH
+    // acknowledge now, the change is stored when the learn session ends
+    sendTeachAcks();
+#else
+    // acknowledge once the change has been stored
+    EVENTTABLE_REQUEST_FLUSH(sendTeachAcks);
 #endif
 }
 
@@ -802,6 +1294,10 @@ static void doReqev(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum) {
             // send all of the EVs
             // Note this somewhat abuses the type parameter
             timedResponseOpcode = OPC_EVANS;
+#ifdef EVENT_RANGES
+            // keep the range handle for the whole response
+            reqevHandle = tableIndex;
+#endif
             startTimedResponse(tableIndex, findServiceIndex(SERVICE_ID_OLD_TEACH), reqevCallback);
             return;
         }
@@ -832,10 +1328,15 @@ static void doReqev(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum) {
 TimedResponseResult reqevCallback(uint8_t tableIndex, uint8_t serviceIndex, uint8_t step){
     Word nodeNumber, eventNumber;
 
-    uint8_t nEv = numEv(tableIndex);
+    uint8_t nEv;
     int16_t ev;
+    
+    nEv = numEv(tableIndex);
     // The step is used to index through the event table
     if (step+1 > nEv) {  // finished?
+#ifdef EVENT_RANGES
+        reqevHandle = NO_INDEX;
+#endif
         return TIMED_RESPONSE_RESULT_FINISHED;
     }
     // if its not free and not a continuation then it is start of an event
@@ -864,6 +1365,10 @@ uint8_t removeEvent(uint16_t nodeNumber, uint16_t eventNumber) {
     // need to delete this action from the Event table. 
     uint8_t tableIndex = findEvent(nodeNumber, eventNumber);
     if (tableIndex == NO_INDEX) return CMDERR_INVALID_EVENT; // not found
+#ifdef EVENT_RANGES
+    // a range is removed as a whole, see removeTableEntry()
+    if (validRange(tableIndex)) return CMDERR_INVALID_EVENT;
+#endif
     // found the event to delete
     return removeTableEntry(tableIndex);
 }
@@ -876,43 +1381,80 @@ uint8_t removeEvent(uint16_t nodeNumber, uint16_t eventNumber) {
 static uint8_t removeTableEntry(uint8_t tableIndex) {
     EventTableFlags f;
 
+#ifndef EVENT_TABLE_LOG
+    finishCompaction();
+#endif
+#ifdef EVENT_RANGES
+    if ((tableIndex >= EVENTRANGE_INDEX(0)) && (tableIndex < EVENTRANGE_INDEX(EVENT_RANGES))) {
+        // the index of the range entry itself removes the whole range
+        if ( ! validRange(tableIndex)) {
+            return CMDERR_INVALID_EVENT;
+        }
+        return removeEventRange(tableIndex - EVENTRANGE_INDEX(0));
+    }
+    if (validRange(tableIndex)) {
+        // a single event cannot be removed from a range
+        return CMDERR_INVALID_EVENT;
+    }
+#endif
 #ifdef SAFETY
     if (tableIndex >= NUM_EVENTS) return CMDERR_INV_EV_IDX;
+#endif
+#ifdef EVENT_LOOKUP_CACHE
+    lookupCacheUsed = 0;
+#endif
+#ifdef EVENT_EV_CACHE
+    clearEvCache();
 #endif
     if (validStart(tableIndex)) {
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+#ifdef EVENT_HASH_TABLE
+        if (learnSession) {
+            removeFromHashtable(tableIndex);
+        }
+#endif
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
         // set the free flag
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, 0xff);
+        EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), 0xff);
+        setRowFree(tableIndex);
+        numValidEvents--;
         // Now follow the next pointer
         while (f.continued) {
-            tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
-            f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+            tableIndex = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
+            f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
         
             if (tableIndex >= NUM_EVENTS) return CMDERR_INV_EV_IDX; // shouldn't be necessary
                     
             // set the free flag
-            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, 0xff);
-        
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), 0xff);
+            setRowFree(tableIndex);
         }
-        flushFlashBlock();
+        if ( ! learnSession) {
+            EVENTTABLE_FLUSH();
 #ifdef EVENT_HASH_TABLE
-        // easier to rebuild from scratch
-        rebuildHashtable();
+            // easier to rebuild from scratch
+            rebuildHashtable();
 #endif
+        }
     }
     return 0;
 }
 
 /**
  * Check to see if any event entries can be removed. Entries can be removed if 
- * their EVs are all set to EV_FILL.
+ * their EVs are all set to EV_FILL. With EVENT_RANGES this includes a range
+ * given by the index of its range entry.
  * 
  * @param tableIndex
  */
 void checkRemoveTableEntry(uint8_t tableIndex) {
     uint8_t e;
     
+#ifdef EVENT_RANGES
+    if (((tableIndex >= EVENTRANGE_INDEX(0)) && (tableIndex < EVENTRANGE_INDEX(EVENT_RANGES)) && validRange(tableIndex)) ||
+            ((tableIndex < NUM_EVENTS) && validStart(tableIndex))) {
+#else
     if ( validStart(tableIndex)) {
+#endif
         if (getEVs(tableIndex)) {
             return;
         }
@@ -941,9 +1483,18 @@ void checkRemoveTableEntry(uint8_t tableIndex) {
  */
 uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8_t evVal, Boolean forceOwnNN) {
     uint8_t tableIndex;
-    uint8_t error;
+    Boolean newEvent = FALSE;
+#ifndef EVENT_TABLE_LOG
+    finishCompaction();
+#endif
     // do we currently have an event
     tableIndex = findEvent(nodeNumber, eventNumber);
+#ifdef EVENT_RANGES
+    if (validRange(tableIndex)) {
+        // the EVs of a range are changed with addEventRange()
+        return CMDERR_INVALID_EVENT;
+    }
+#endif
     if (tableIndex == NO_INDEX) {
         // Ian - 2k check for special case. Don't create an entry for a EV_FILL
         // This is a solution to the problem of FCU filling the event table with unused
@@ -953,31 +1504,35 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
         if (evVal == EV_FILL) {
             return 0;
         }
-        error = 1;
         // didn't find the event so find an empty slot and create one
-        for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        tableIndex = findFreeRow(0);
+        if (tableIndex == NO_INDEX) {
+            return CMDERR_TOO_MANY_EVENTS;
+        } else {
             EventTableFlags f;
-            f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-            if (f.freeEntry) {
-                uint8_t e;
-                // found a free slot, initialise it
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN, nodeNumber&0xFF);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN+1, nodeNumber>>8);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN, eventNumber&0xFF);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN+1, eventNumber>>8);
-                f.asByte = 0;
-                f.forceOwnNN = forceOwnNN?1:0;
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, f.asByte);
-            
-                for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+e, EV_FILL);
-                }
-                error = 0;
-                break;
+            uint8_t e;
+            // found a free slot, initialise it
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NN), nodeNumber&0xFF);
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NN+1), nodeNumber>>8);
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_EN), eventNumber&0xFF);
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_EN+1), eventNumber>>8);
+            f.asByte = 0;
+            f.forceOwnNN = forceOwnNN?1:0;
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), f.asByte);
+#ifdef EVENTTABLE_EXTENDED_EVSUSED
+            EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_EVSUSED), 0);
+#endif
+        
+            for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
+                EVENTTABLE_WRITE(EVENTTABLE_EV_ADDRESS(tableIndex, e), EV_FILL);
             }
-        }
-        if (error) {
-            return CMDERR_TOO_MANY_EVENTS;
+            setRowInUse(tableIndex);
+            numValidEvents++;
+            newEvent = TRUE;
+#ifdef EVENT_LOOKUP_CACHE
+            // the cache may hold this event as not found
+            lookupCacheUsed = 0;
+#endif
         }
     }
  
@@ -986,7 +1541,16 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
         return CMDERR_INV_EV_IDX;
     }
     // success
-    flushFlashBlock();
+    if (learnSession) {
+        // doEvlrn() commits the change, the hash table is rebuilt at the end of the session
+#ifdef EVENT_HASH_TABLE
+        if (newEvent) {
+            addToHashtable(tableIndex);
+        }
+#endif
+        return 0;
+    }
+    EVENTTABLE_FLUSH();
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -995,42 +1559,146 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
 
 /**
  * Find an event in the event table and return its index.
+ * With EVENT_RANGES an event within a range, other than its first, is given the
+ * index of a range handle which remains valid until EVENT_RANGE_HANDLES other 
+ * such events have been found.
  * 
  * @param nodeNumber event NN
  * @param eventNumber event EN
  * @return index into event table or NO_INDEX if not present
  */
 uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
-#ifdef EVENT_HASH_TABLE
-    uint8_t hash = getHash(nodeNumber, eventNumber);
-    uint8_t chainIdx;
-    for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
-        uint8_t tableIndex = eventChains[hash][chainIdx];
-        uint16_t nn, en;
-        if (tableIndex == NO_INDEX) return NO_INDEX;
-        nn = getNN(tableIndex);
-        en = getEN(tableIndex);
-        if ((nn == nodeNumber) && (en == eventNumber)) {
-            return tableIndex;
-        }
-    }
-#else
     uint8_t tableIndex;
-    for (tableIndex=0; tableIndex < NUM_EVENTS; tableIndex++) {
-        EventTableFlags f;
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-        if (( ! f.freeEntry) && ( ! f.continuation)) {
-            uint16_t node, en;
-            node = getNN(tableIndex);
-            en = getEN(tableIndex);
-            if ((node == nodeNumber) && (en == eventNumber)) {
-                return tableIndex;
-            }
+#ifdef EVENT_LOOKUP_CACHE
+    LookupCacheEntry entry;
+    uint8_t i;
+    
+    for (i=0; i<lookupCacheUsed; i++) {
+        if ((lookupCache[i].nodeNumber == nodeNumber) && (lookupCache[i].eventNumber == eventNumber)) {
+            break;
         }
     }
+    if (i < lookupCacheUsed) {
+#ifdef VLCB_DIAG
+        teachDiagnostics[TEACH_DIAG_CACHE_HITS].asUint++;
 #endif
-    return NO_INDEX;
-}
+        entry = lookupCache[i];
+    } else {
+#ifdef VLCB_DIAG
+        teachDiagnostics[TEACH_DIAG_CACHE_MISSES].asUint++;
+#endif
+        entry.nodeNumber = nodeNumber;
+        entry.eventNumber = eventNumber;
+        entry.tableIndex = lookupEvent(nodeNumber, eventNumber);
+        if (lookupCacheUsed < EVENT_LOOKUP_CACHE) {
+            lookupCacheUsed++;
+        }
+        // replace the least recently used entry
+        i = lookupCacheUsed-1;
+    }
+    // move to the front as the most recently used
+    for (; i>0; i--) {
+        lookupCache[i] = lookupCache[i-1];
+    }
+    lookupCache[0] = entry;
+    tableIndex = entry.tableIndex;
+#else
+    tableIndex = lookupEvent(nodeNumber, eventNumber);
+#endif
+#ifdef EVENT_RANGES
+    if (tableIndex == NO_INDEX) {
+        // events taught individually take priority over ranges
+        tableIndex = findEventRange(nodeNumber, eventNumber);
+    }
+#endif
+    return tableIndex;
+}
+
+/**
+ * Find an event using the hash table or the event table.
+ * 
+ * @param nodeNumber event NN
+ * @param eventNumber event EN
+ * @return index into event table or NO_INDEX if not present
+ */
+static uint8_t lookupEvent(uint16_t nodeNumber, uint16_t eventNumber) {
+#ifdef EVENT_HASH_TABLE
+    uint8_t hash;
+    uint8_t chainIdx;
+#endif
+#ifdef VLCB_DIAG
+    teachDiagnostics[TEACH_DIAG_LOOKUPS].asUint++;
+#endif
+#ifdef EVENT_HASH_TABLE
+#ifdef EVENT_BLOOM_BITS
+    // quick reject of events we have not been taught
+    if ( ! bloomMayContain(nodeNumber, eventNumber)) return NO_INDEX;
+#endif
+    hash = getHash(nodeNumber, eventNumber);
+    for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+        uint8_t tableIndex = eventChains[hash][chainIdx];
+        uint16_t nn, en;
+        if (tableIndex == NO_INDEX) break;
+#ifdef VLCB_DIAG
+        teachDiagnostics[TEACH_DIAG_LOOKUP_ROWS].asUint++;
+#endif
+        nn = getNN(tableIndex);
+        en = getEN(tableIndex);
+        if ((nn == nodeNumber) && (en == eventNumber)) {
+            return tableIndex;
+        }
+    }
+#ifdef EVENT_HASH_OVERFLOW
+    if (chainIdx == EVENT_CHAIN_LENGTH) {
+        // the chain is full so the event may be in the overflow area
+        for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+            uint8_t tableIndex = eventOverflow[chainIdx];
+            if (tableIndex == NO_INDEX) break;
+#ifdef VLCB_DIAG
+            teachDiagnostics[TEACH_DIAG_LOOKUP_ROWS].asUint++;
+#endif
+            if ((getNN(tableIndex) == nodeNumber) && (getEN(tableIndex) == eventNumber)) {
+                return tableIndex;
+            }
+        }
+    }
+#endif
+    if (hashIncomplete) {
+        return scanForEvent(nodeNumber, eventNumber);
+    }
+    return NO_INDEX;
+#else
+    return scanForEvent(nodeNumber, eventNumber);
+#endif
+}
+
+/**
+ * Find an event by searching the event table.
+ * 
+ * @param nodeNumber event NN
+ * @param eventNumber event EN
+ * @return index into event table or NO_INDEX if not present
+ */
+static uint8_t scanForEvent(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t tableIndex;
+    for (tableIndex=0; tableIndex < NUM_EVENTS; tableIndex++) {
+        EventTableFlags f;
+        if ( ! ROW_IN_USE(tableIndex)) continue;
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+        if (( ! f.freeEntry) && ( ! f.continuation)) {
+            uint16_t node, en;
+#ifdef VLCB_DIAG
+            teachDiagnostics[TEACH_DIAG_LOOKUP_ROWS].asUint++;
+#endif
+            node = getNN(tableIndex);
+            en = getEN(tableIndex);
+            if ((node == nodeNumber) && (en == eventNumber)) {
+                return tableIndex;
+            }
+        }
+    }
+    return NO_INDEX;
+}
 
 /**
  * Write an EV value to an event.
@@ -1043,18 +1711,27 @@ uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
 uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
     EventTableFlags f;
     uint8_t startIndex = tableIndex;
+#ifdef EVENT_EV_CACHE
+    clearEvCache();
+#endif
     if (evNum >= PARAM_NUM_EV_EVENT) {
         return CMDERR_INV_EV_IDX;
     }
+#ifdef EVENT_RANGES
+    if (validRange(tableIndex)) {
+        // the EVs of a range are changed with addEventRange()
+        return CMDERR_INVALID_EVENT;
+    }
+#endif
     while (evNum >= EVENT_TABLE_WIDTH) {
         uint8_t nextIdx;
         
         // skip forward looking for the right chained table entry
         evNum -= EVENT_TABLE_WIDTH;
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
         
         if (f.continued) {
-            tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+            tableIndex = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
             if (tableIndex == NO_INDEX) {
                 return CMDERR_INVALID_EVENT;
             }
@@ -1069,42 +1746,40 @@ uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
                 return 0;
             }
             // find the next free entry
-            for (nextIdx = tableIndex+1 ; nextIdx < NUM_EVENTS; nextIdx++) {
-                EventTableFlags nextF;
-                nextF.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_FLAGS);
-                if (nextF.freeEntry) {
-                    uint8_t e;
-                     // found a free slot, initialise it
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_NN, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_NN+1, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EN, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EN+1, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_FLAGS, 0x20);    // set continuation flag, clear free and numEV to 0
-                    for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
-                        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EVS+e, EV_FILL); // clear the EVs
-                    }
-                    // set the next of the previous in chain
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT, nextIdx);
-                    // set the continued flag
-                    f.continued = 1;
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, f.asByte);
-                    tableIndex = nextIdx;
-                    break;
-                }
-            }
-            if (nextIdx >= NUM_EVENTS) {
+            nextIdx = findFreeRow(tableIndex+1);
+            if (nextIdx == NO_INDEX) {
                 // ran out of table entries
                 return CMDERR_TOO_MANY_EVENTS;
+            } else {
+                uint8_t e;
+                // found a free slot, initialise it
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(nextIdx, EVENTTABLE_OFFSET_NN), 0xff); // this field not used
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(nextIdx, EVENTTABLE_OFFSET_NN+1), 0xff); // this field not used
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(nextIdx, EVENTTABLE_OFFSET_EN), 0xff); // this field not used
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(nextIdx, EVENTTABLE_OFFSET_EN+1), 0xff); // this field not used
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(nextIdx, EVENTTABLE_OFFSET_FLAGS), 0x20);    // set continuation flag, clear free and numEV to 0
+#ifdef EVENTTABLE_EXTENDED_EVSUSED
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(nextIdx, EVENTTABLE_OFFSET_EVSUSED), 0);
+#endif
+                for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
+                    EVENTTABLE_WRITE(EVENTTABLE_EV_ADDRESS(nextIdx, e), EV_FILL); // clear the EVs
+                }
+                // set the next of the previous in chain
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT), nextIdx);
+                // set the continued flag
+                f.continued = 1;
+                EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), f.asByte);
+                setRowInUse(nextIdx);
+                tableIndex = nextIdx;
             }
         } 
     }
     // now write the EV
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evNum, evVal);
+    EVENTTABLE_WRITE(EVENTTABLE_EV_ADDRESS(tableIndex, evNum), evVal);
     // update the number per row count
-    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-    if (f.eVsUsed <= evNum) {
-        f.eVsUsed = evNum+1U;
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, f.asByte);
+    f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+    if (getEvsUsed(tableIndex, f) <= evNum) {
+        setEvsUsed(tableIndex, f, evNum+1U);
     }
     // If we are deleting then see if we can remove all
     if (evVal == EV_FILL) {
@@ -1122,6 +1797,32 @@ uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
  */
 int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
     EventTableFlags f;
+#ifdef EVENT_EV_CACHE
+    uint8_t c;
+#endif
+#ifdef EVENT_RANGES
+    uint8_t range;
+    uint8_t offset;
+    
+    range = indexToRange(tableIndex, &offset);
+    if (range != NO_RANGE) {
+        return getRangeEv(range, offset, evNum);
+    }
+#endif
+#ifdef EVENT_EV_CACHE
+    c = getEvCache(tableIndex);
+    if (c == NO_INDEX) {
+        // not a valid start
+        return -CMDERR_INVALID_EVENT;
+    }
+    if (evNum >= PARAM_NUM_EV_EVENT) {
+        return -CMDERR_INV_EV_IDX;
+    }
+    if (evNum >= evCache[c].numEvs) {
+        return -CMDERR_NO_EV;
+    }
+    return evCache[c].evs[evNum];
+#else
     if ( ! validStart(tableIndex)) {
         // not a valid start
         return -CMDERR_INVALID_EVENT;
@@ -1129,27 +1830,126 @@ int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
     if (evNum >= PARAM_NUM_EV_EVENT) {
         return -CMDERR_INV_EV_IDX;
     }
-    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
     while (evNum >= EVENT_TABLE_WIDTH) {
         // if evNum is beyond current EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_ entry move to next one
         if (! f.continued) {
             return -CMDERR_NO_EV;
         }
-        tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+        tableIndex = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
         if (tableIndex == NO_INDEX) {
             return -CMDERR_INVALID_EVENT;
         }
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
         evNum -= EVENT_TABLE_WIDTH;
     }
-    if (evNum+1 > f.eVsUsed) {
+    if (evNum+1 > getEvsUsed(tableIndex, f)) {
         if (f.continued) {
             return EV_FILL;
         }
         return -CMDERR_NO_EV;
     }
     // it is within this entry
-    return (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evNum);
+    return (uint8_t)EVENTTABLE_READ(EVENTTABLE_EV_ADDRESS(tableIndex, evNum));
+#endif
+}
+
+#ifdef EVENT_EV_CACHE
+/**
+ * Get the EV cache entry for an event, loading the EVs from the event table if
+ * the event is not already cached.
+ * 
+ * @param tableIndex the index of the start of the event
+ * @return the index into evCache or NO_INDEX if tableIndex is not a valid start
+ */
+static uint8_t getEvCache(uint8_t tableIndex) {
+    EventTableFlags f;
+    uint8_t i;
+    uint8_t c;
+    uint8_t e;
+    uint8_t evNum;
+    uint8_t used;
+    
+    for (i=0; i<EVENT_EV_CACHE; i++) {
+        c = evCacheOrder[i];
+        if (evCache[c].tableIndex == tableIndex) break;
+    }
+    if (i == EVENT_EV_CACHE) {
+        // not cached so replace the least recently used entry
+        if ( ! validStart(tableIndex)) return NO_INDEX;
+        i = EVENT_EV_CACHE-1;
+        c = evCacheOrder[i];
+        evCache[c].tableIndex = tableIndex;
+        evCache[c].numEvs = 0;
+        // walk the chain once, decoding the EVs in the same way as getEv
+        evNum = 0;
+        for (;;) {
+            f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+            used = getEvsUsed(tableIndex, f);
+            for (e=0; (e<EVENT_TABLE_WIDTH) && (evNum<PARAM_NUM_EV_EVENT); e++, evNum++) {
+                if (e < used) {
+                    evCache[c].evs[evNum] = (uint8_t)EVENTTABLE_READ(EVENTTABLE_EV_ADDRESS(tableIndex, e));
+                } else if (f.continued) {
+                    evCache[c].evs[evNum] = EV_FILL;
+                } else {
+                    break;
+                }
+                evCache[c].numEvs = evNum+1;
+            }
+            if (( ! f.continued) || (evNum >= PARAM_NUM_EV_EVENT)) break;
+            tableIndex = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
+            if (tableIndex >= NUM_EVENTS) break;
+        }
+    }
+    // move to the front as the most recently used
+    for (; i>0; i--) {
+        evCacheOrder[i] = evCacheOrder[i-1];
+    }
+    evCacheOrder[0] = c;
+    return c;
+}
+
+/**
+ * Remove all events from the EV cache. Called whenever the event table is changed.
+ */
+static void clearEvCache(void) {
+    uint8_t i;
+    for (i=0; i<EVENT_EV_CACHE; i++) {
+        evCache[i].tableIndex = NO_INDEX;
+        evCacheOrder[i] = i;
+    }
+}
+#endif
+
+/**
+ * Get the number of EVs used in a row of the event table.
+ * 
+ * @param tableIndex the index of the row
+ * @param f the flags of the row
+ * @return the number of EVs used in this row
+ */
+static uint8_t getEvsUsed(uint8_t tableIndex, EventTableFlags f) {
+#ifdef EVENTTABLE_EXTENDED_EVSUSED
+    return (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_EVSUSED));
+#else
+    return f.eVsUsed;
+#endif
+}
+
+/**
+ * Set the number of EVs used in a row of the event table.
+ * 
+ * @param tableIndex the index of the row
+ * @param f the current flags of the row
+ * @param num the number of EVs used in this row
+ */
+static void setEvsUsed(uint8_t tableIndex, EventTableFlags f, uint8_t num) {
+#ifdef EVENTTABLE_EXTENDED_EVSUSED
+    EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_EVSUSED), num);
+#else
+    f.eVsUsed = num;
+    EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), f.asByte);
+#endif
 }
 
 /**
@@ -1161,20 +1961,26 @@ int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
 uint8_t numEv(uint8_t tableIndex) {
     EventTableFlags f;
     uint8_t num=0;
+#ifdef EVENT_RANGES
+    if (validRange(tableIndex)) {
+        // all the EVs of a range are stored
+        return PARAM_NUM_EV_EVENT;
+    }
+#endif
     if ( ! validStart(tableIndex)) {
         // not a valid start
         return 0;
     }
-    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
     while (f.continued) {
-        tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+        tableIndex = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
         if (tableIndex == NO_INDEX) {
             return 0;
         }
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
         num += EVENT_TABLE_WIDTH;
     }
-    num += f.eVsUsed;
+    num += getEvsUsed(tableIndex, f);
     return num;
 }
 
@@ -1191,25 +1997,38 @@ uint8_t evs[PARAM_NUM_EV_EVENT];
 uint8_t getEVs(uint8_t tableIndex) {
     EventTableFlags f;
     uint8_t evNum;
+#ifdef EVENT_RANGES
+    uint8_t range;
+    uint8_t offset;
     
+    range = indexToRange(tableIndex, &offset);
+    if (range != NO_RANGE) {
+        for (evNum=0; evNum < PARAM_NUM_EV_EVENT; evNum++) {
+            evs[evNum] = (uint8_t)getRangeEv(range, offset, evNum);
+        }
+        return 0;
+    }
+#endif
     if ( ! validStart(tableIndex)) {
         // not a valid start
         return CMDERR_INVALID_EVENT;
     }
     for (evNum=0; evNum < PARAM_NUM_EV_EVENT; ) {
-        uint8_t evIdx;
-        for (evIdx=0; evIdx < EVENT_TABLE_WIDTH; evIdx++) {
-            evs[evNum] = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evIdx);
-            evNum++;
+        uint8_t evCount;
+        evCount = PARAM_NUM_EV_EVENT - evNum;
+        if (evCount > EVENT_TABLE_WIDTH) {
+            evCount = EVENT_TABLE_WIDTH;
         }
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+        EVENTTABLE_READ_BLOCK(EVENTTABLE_EV_ADDRESS(tableIndex, 0), &evs[evNum], evCount);
+        evNum += evCount;
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
         if (! f.continued) {
             for (; evNum < PARAM_NUM_EV_EVENT; evNum++) {
                 evs[evNum] = EV_FILL;
             }
             return 0;
         }
-        tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+        tableIndex = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NEXT));
         if (tableIndex == NO_INDEX) {
             return CMDERR_INVALID_EVENT;
         }
@@ -1225,17 +2044,24 @@ uint8_t getEVs(uint8_t tableIndex) {
  * @return the Node Number
  */
 uint16_t getNN(uint8_t tableIndex) {
-    uint16_t hi;
-    uint16_t lo;
+    uint8_t header[EVENTTABLE_OFFSET_NN+2];
     EventTableFlags f;
+#ifdef EVENT_RANGES
+    uint8_t range;
+    uint8_t offset;
     
-    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    range = indexToRange(tableIndex, &offset);
+    if (range != NO_RANGE) {
+        return eventRanges[range].nodeNumber;
+    }
+#endif
+    // read the flags through to the NN in one go
+    EVENTTABLE_READ_BLOCK(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), header, sizeof(header));
+    f.asByte = header[EVENTTABLE_OFFSET_FLAGS];
     if (f.forceOwnNN) {
         return nn.word;
     }
-    lo = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN);
-    hi = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN+1);
-    return lo | (hi << 8);
+    return header[EVENTTABLE_OFFSET_NN] | ((uint16_t)header[EVENTTABLE_OFFSET_NN+1] << 8);
 }
 
 /**
@@ -1246,12 +2072,18 @@ uint16_t getNN(uint8_t tableIndex) {
  * @return the Event Number
  */
 uint16_t getEN(uint8_t tableIndex) {
-    uint16_t hi;
-    uint16_t lo;
+    uint8_t en[2];
+#ifdef EVENT_RANGES
+    uint8_t range;
+    uint8_t offset;
     
-    lo = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN);
-    hi = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN+1);
-    return lo | (hi << 8);
+    range = indexToRange(tableIndex, &offset);
+    if (range != NO_RANGE) {
+        return eventRanges[range].first + offset;
+    }
+#endif
+    EVENTTABLE_READ_BLOCK(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_EN), en, 2);
+    return en[0] | ((uint16_t)en[1] << 8);
 }
 
 /**
@@ -1292,7 +2124,7 @@ Boolean validStart(uint8_t tableIndex) {
 #ifdef SAFETY
     if (tableIndex >= NUM_EVENTS) return FALSE;
 #endif
-    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
     if (( !f.freeEntry) && ( ! f.continuation)) {
         return TRUE;
     } else {
@@ -1300,6 +2132,434 @@ Boolean validStart(uint8_t tableIndex) {
     }
 }
 
+/**
+ * Build the occupancy bitmap from the flags of each row in the event table.
+ */
+static void loadRowsInUse(void) {
+    uint8_t tableIndex;
+    for (tableIndex=0; tableIndex<sizeof(rowsInUse); tableIndex++) {
+        rowsInUse[tableIndex] = 0;
+    }
+    numFreeRows = NUM_EVENTS;
+    numValidEvents = 0;
+    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        EventTableFlags f;
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+        if ( ! f.freeEntry) {
+            setRowInUse(tableIndex);
+            if ( ! f.continuation) {
+                numValidEvents++;
+            }
+        }
+    }
+}
+
+/**
+ * Free any continuation rows which are not reached from the start row of an 
+ * event. These can be left by a power failure whilst a chain is being changed.
+ * Must be called after loadRowsInUse().
+ */
+static void freeOrphanRows(void) {
+    uint8_t reached[(NUM_EVENTS+7)/8];
+    EventTableFlags f;
+    uint8_t tableIndex;
+    uint8_t next;
+    uint8_t count;
+    Boolean freed;
+    
+    for (tableIndex=0; tableIndex<sizeof(reached); tableIndex++) {
+        reached[tableIndex] = 0;
+    }
+    // mark the continuation rows reached from each start row
+    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        if ( ! ROW_IN_USE(tableIndex)) continue;
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+        if (f.continuation) continue;
+        next = tableIndex;
+        for (count=0; f.continued && (count<NUM_EVENTS); count++) {
+            next = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(next, EVENTTABLE_OFFSET_NEXT));
+            if ((next >= NUM_EVENTS) || ! ROW_IN_USE(next)) break;
+            f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(next, EVENTTABLE_OFFSET_FLAGS));
+            if ( ! f.continuation) break;
+            reached[next>>3] |= teachBitMask[next&7];
+        }
+    }
+    // free the continuation rows which were not reached
+    freed = FALSE;
+    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        if ( ! ROW_IN_USE(tableIndex)) continue;
+        if (reached[tableIndex>>3] & teachBitMask[tableIndex&7]) continue;
+        f.asByte = (uint8_t)EVENTTABLE_READ(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS));
+        if ( ! f.continuation) continue;
+        EVENTTABLE_WRITE(EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), 0xff);
+        setRowFree(tableIndex);
+        freed = TRUE;
+    }
+    if (freed) {
+        EVENTTABLE_FLUSH();
+    }
+}
+
+/**
+ * Mark a row as in use in the occupancy bitmap.
+ * @param tableIndex the row
+ */
+static void setRowInUse(uint8_t tableIndex) {
+    if ( ! ROW_IN_USE(tableIndex)) {
+        rowsInUse[tableIndex>>3] |= teachBitMask[tableIndex&7];
+        numFreeRows--;
+    }
+}
+
+/**
+ * Mark a row as free in the occupancy bitmap.
+ * @param tableIndex the row
+ */
+static void setRowFree(uint8_t tableIndex) {
+    if (ROW_IN_USE(tableIndex)) {
+        rowsInUse[tableIndex>>3] &= (uint8_t)~teachBitMask[tableIndex&7];
+        numFreeRows++;
+    }
+}
+
+/**
+ * Find the first free row in the event table at or after the specified index.
+ * Uses the occupancy bitmap so skips 8 rows at a time when they are all in use.
+ * 
+ * @param tableIndex the index to start searching from
+ * @return the index of a free row or NO_INDEX if there is none
+ */
+static uint8_t findFreeRow(uint8_t tableIndex) {
+    uint16_t i = tableIndex;    // 16 bit so it cannot wrap when skipping a whole byte
+    while (i < NUM_EVENTS) {
+        if (((i & 7) == 0) && (rowsInUse[i>>3] == 0xFF)) {
+            i += 8;
+            continue;
+        }
+        if ( ! ROW_IN_USE(i)) {
+            return (uint8_t)i;
+        }
+        i++;
+    }
+    return NO_INDEX;
+}
+
+/**
+ * Find the first row, starting from tableIndex, which is the start of an event.
+ * Uses the occupancy bitmap to skip over free rows without reading the event table.
+ * 
+ * @param tableIndex the row to start searching from
+ * @return the index of the start of the event or NO_INDEX if there are no more
+ */
+static uint8_t findValidStart(uint8_t tableIndex) {
+    uint16_t i = tableIndex;    // 16 bit so it cannot wrap when skipping a whole byte
+    while (i < NUM_EVENTS) {
+        if (((i & 7) == 0) && (rowsInUse[i>>3] == 0)) {
+            i += 8;
+            continue;
+        }
+        if (ROW_IN_USE(i) && validStart((uint8_t)i)) {
+            return (uint8_t)i;
+        }
+        i++;
+    }
+    return NO_INDEX;
+}
+
+#ifdef EVENT_RANGES
+/**
+ * Read a 16 bit field of a range entry.
+ * @param range the range entry
+ * @param offset the byte index of the field within the range entry
+ * @return the field value
+ */
+static uint16_t readRangeWord(uint8_t range, uint8_t offset) {
+    uint16_t hi;
+    uint16_t lo;
+    
+    lo = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(range, offset));
+    hi = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(range, offset+1));
+    return lo | (hi << 8);
+}
+
+/**
+ * Load the RAM copy of the range entries from NVM.
+ */
+static void loadEventRanges(void) {
+    uint8_t r;
+    for (r=0; r<EVENT_RANGES; r++) {
+        if ((uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_FLAGS)) == 0) {
+            eventRanges[r].nodeNumber = readRangeWord(r, EVENTRANGE_OFFSET_NN);
+            eventRanges[r].first = readRangeWord(r, EVENTRANGE_OFFSET_FIRST);
+            eventRanges[r].last = readRangeWord(r, EVENTRANGE_OFFSET_LAST);
+        } else {
+            eventRanges[r].first = 0xFFFF;
+            eventRanges[r].last = 0;
+        }
+    }
+    freeRangeHandles(NO_RANGE);
+    reqevHandle = NO_INDEX;
+}
+
+/**
+ * Remove all of the range entries.
+ */
+static void clearEventRanges(void) {
+    uint8_t r;
+    for (r=0; r<EVENT_RANGES; r++) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_FLAGS), 0xFF);
+        eventRanges[r].first = 0xFFFF;
+        eventRanges[r].last = 0;
+    }
+    flushNVM(EVENT_TABLE_NVM_TYPE);
+    freeRangeHandles(NO_RANGE);
+}
+
+/**
+ * Free the range handles of a range entry so that indices for its events are
+ * no longer valid.
+ * 
+ * @param range the range entry or NO_RANGE for all range entries
+ */
+static void freeRangeHandles(uint8_t range) {
+    uint8_t h;
+    for (h=0; h<EVENT_RANGE_HANDLES; h++) {
+        if ((range == NO_RANGE) || (rangeHandles[h].range == range)) {
+            rangeHandles[h].range = NO_RANGE;
+        }
+    }
+}
+
+/**
+ * Find the range entry which covers an event.
+ * 
+ * @param nodeNumber event NN
+ * @param eventNumber event EN
+ * @return the index of the range entry for the first event of a range, 
+ * otherwise of a range handle for the event, or NO_INDEX
+ */
+static uint8_t findEventRange(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t r;
+    uint8_t h;
+    uint8_t offset;
+    for (r=0; r<EVENT_RANGES; r++) {
+        if ((eventRanges[r].nodeNumber == nodeNumber) && 
+                (eventNumber >= eventRanges[r].first) && 
+                (eventNumber <= eventRanges[r].last)) {
+            // addEventRange() limits a range to 256 events
+            offset = (uint8_t)(eventNumber - eventRanges[r].first);
+            if (offset == 0) {
+                return EVENTRANGE_INDEX(r);
+            }
+            for (h=0; h<EVENT_RANGE_HANDLES; h++) {
+                if ((rangeHandles[h].range == r) && (rangeHandles[h].offset == offset)) {
+                    return EVENTRANGE_HANDLE_INDEX(h);
+                }
+            }
+            h = nextRangeHandle;
+            if (EVENTRANGE_HANDLE_INDEX(h) == reqevHandle) {
+                // still being used by reqevCallback()
+                h = (uint8_t)((h+1) % EVENT_RANGE_HANDLES);
+            }
+            nextRangeHandle = (uint8_t)((h+1) % EVENT_RANGE_HANDLES);
+            rangeHandles[h].range = r;
+            rangeHandles[h].offset = offset;
+            return EVENTRANGE_HANDLE_INDEX(h);
+        }
+    }
+    return NO_INDEX;
+}
+
+/**
+ * Obtain the range entry and the position of the event within it from an 
+ * index returned by findEvent().
+ * 
+ * @param tableIndex the index as returned by findEvent()
+ * @param offset set to the position of the EN within the range
+ * @return the range entry or NO_RANGE if the index is not for a range in use
+ */
+static uint8_t indexToRange(uint8_t tableIndex, uint8_t * offset) {
+    uint8_t r;
+    
+    if (tableIndex < EVENTRANGE_INDEX(0)) {
+        return NO_RANGE;
+    }
+    if (tableIndex < EVENTRANGE_INDEX(EVENT_RANGES)) {
+        r = tableIndex - EVENTRANGE_INDEX(0);
+        *offset = 0;
+    } else if (tableIndex < EVENTRANGE_HANDLE_INDEX(EVENT_RANGE_HANDLES)) {
+        r = rangeHandles[tableIndex - EVENTRANGE_HANDLE_INDEX(0)].range;
+        if (r == NO_RANGE) {
+            return NO_RANGE;
+        }
+        *offset = rangeHandles[tableIndex - EVENTRANGE_HANDLE_INDEX(0)].offset;
+    } else {
+        return NO_RANGE;
+    }
+    if (eventRanges[r].first > eventRanges[r].last) {
+        return NO_RANGE;
+    }
+    return r;
+}
+
+/**
+ * Checks if the specified index is for a range entry, or range handle, which is in use.
+ * 
+ * @param tableIndex the index as returned by findEvent()
+ * @return true if the index is for an event of a range
+ */
+static Boolean validRange(uint8_t tableIndex) {
+    uint8_t offset;
+    return (indexToRange(tableIndex, &offset) != NO_RANGE);
+}
+
+/**
+ * Return an EV value for the event at offset within a range. The first
+ * EVENT_RANGE_OFFSET_EVS EVs have the offset added unless they are EV_FILL.
+ * 
+ * @param range the range entry
+ * @param offset the position of the event within the range
+ * @param evNum ev number starts at 0 (Happening)
+ * @return the ev value or -error code if error
+ */
+static int16_t getRangeEv(uint8_t range, uint8_t offset, uint8_t evNum) {
+    uint8_t evVal;
+    
+    if (evNum >= PARAM_NUM_EV_EVENT) {
+        return -CMDERR_INV_EV_IDX;
+    }
+    evVal = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(range, EVENTRANGE_OFFSET_EVS+evNum));
+    if ((evNum < EVENT_RANGE_OFFSET_EVS) && (evVal != EV_FILL)) {
+        evVal += offset;
+    }
+    return evVal;
+}
+
+/**
+ * Write an EV value of a range. This changes the EV for every event of the range.
+ * 
+ * @param range the range entry
+ * @param evNum the EV number (0 for the produced action)
+ * @param evVal the EV value for the first event of the range
+ * @return 0 if success otherwise the error
+ */
+static uint8_t writeRangeEv(uint8_t range, uint8_t evNum, uint8_t evVal) {
+    if (evNum >= PARAM_NUM_EV_EVENT) {
+        return CMDERR_INV_EV_IDX;
+    }
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(range, EVENTRANGE_OFFSET_EVS+evNum), evVal);
+    flushNVM(EVENT_TABLE_NVM_TYPE);
+    return 0;
+}
+
+/**
+ * Remove a range entry.
+ * 
+ * @param range the range entry
+ * @return error or 0 for success
+ */
+static uint8_t removeEventRange(uint8_t range) {
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(range, EVENTRANGE_OFFSET_FLAGS), 0xFF);
+    flushNVM(EVENT_TABLE_NVM_TYPE);
+    eventRanges[range].first = 0xFFFF;
+    eventRanges[range].last = 0;
+    freeRangeHandles(range);
+    return 0;
+}
+
+/**
+ * Add a range entry, or change an EV of an existing range entry, which matches
+ * each of the events from firstEvent to lastEvent inclusive for the NN. The EVs
+ * of the range are those of firstEvent, the first EVENT_RANGE_OFFSET_EVS EVs 
+ * of subsequent events are incremented by the position of the event within 
+ * the range.
+ * 
+ * Events taught individually take priority over a range. The EVs of a range
+ * are only changed by this function; EVLRN and EVULN of an event within the 
+ * range are rejected with CMDERR_INVALID_EVENT. A range is removed by setting
+ * all of its EVs to EV_FILL and calling checkRemoveTableEntry() with the index
+ * of the range entry, as reported by NERD, or by NNCLR.
+ * 
+ * @param nodeNumber the NN of the events
+ * @param firstEvent the first EN of the range
+ * @param lastEvent the last EN of the range, no more than 255 after firstEvent
+ * @param evNum the EV index (starts at 0 for the produced action)
+ * @param evVal the EV value for firstEvent
+ * @return error number or 0 for success
+ */
+uint8_t addEventRange(uint16_t nodeNumber, uint16_t firstEvent, uint16_t lastEvent, uint8_t evNum, uint8_t evVal) {
+    uint8_t r;
+    uint8_t freeRange = NO_INDEX;
+    
+    if ((firstEvent > lastEvent) || (lastEvent - firstEvent > 255)) {
+        // the position within the range must fit in a range handle
+        return CMDERR_INVALID_EVENT;
+    }
+    if (evNum >= PARAM_NUM_EV_EVENT) {
+        return CMDERR_INV_EV_IDX;
+    }
+    for (r=0; r<EVENT_RANGES; r++) {
+        if (eventRanges[r].first > eventRanges[r].last) {
+            if (freeRange == NO_INDEX) {
+                freeRange = r;
+            }
+        } else if ((eventRanges[r].nodeNumber == nodeNumber) && 
+                (eventRanges[r].first == firstEvent) && 
+                (eventRanges[r].last == lastEvent)) {
+            break;
+        }
+    }
+    if (r == EVENT_RANGES) {
+        uint8_t e;
+        
+        if (freeRange == NO_INDEX) {
+            return CMDERR_TOO_MANY_EVENTS;
+        }
+        // initialise a free range entry
+        r = freeRange;
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_NN), nodeNumber&0xFF);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_NN+1), nodeNumber>>8);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_FIRST), firstEvent&0xFF);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_FIRST+1), firstEvent>>8);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_LAST), lastEvent&0xFF);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_LAST+1), lastEvent>>8);
+        for (e=0; e<PARAM_NUM_EV_EVENT; e++) {
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_EVS+e), EV_FILL);
+        }
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTRANGE_ADDRESS(r, EVENTRANGE_OFFSET_FLAGS), 0);
+        eventRanges[r].nodeNumber = nodeNumber;
+        eventRanges[r].first = firstEvent;
+        eventRanges[r].last = lastEvent;
+    }
+    return writeRangeEv(r, evNum, evVal);
+}
+
+/**
+ * Send the next event covered by the range entries as part of the NERD response.
+ * @return whether to finish or continue processing
+ */
+static TimedResponseResult nerdRangeCallback(void) {
+    Word nodeNumber, eventNumber;
+    
+    for (; nerdRange < EVENT_RANGES; nerdRange++) {
+        if (eventRanges[nerdRange].first <= eventRanges[nerdRange].last) {
+            nodeNumber.word = eventRanges[nerdRange].nodeNumber;
+            eventNumber.word = eventRanges[nerdRange].first + nerdRangeOffset;
+            sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(EVENTRANGE_INDEX(nerdRange)));
+            if (eventNumber.word == eventRanges[nerdRange].last) {
+                // move on to the next range entry
+                nerdRange++;
+                nerdRangeOffset = 0;
+            } else {
+                nerdRangeOffset++;
+            }
+            return TIMED_RESPONSE_RESULT_NEXT;
+        }
+    }
+    return TIMED_RESPONSE_RESULT_FINISHED;
+}
+#endif
+
 #ifdef EVENT_HASH_TABLE
 /**
  * Obtain a hash for the specified Event. 
@@ -1315,19 +2575,22 @@ Boolean validStart(uint8_t tableIndex) {
  * This also means that for layouts using the default FLiM node numbers from 256, 
  * we are effectively starting from zero as far as the hash algorithm is concerned.
  * 
+ * If EVENT_HASH_MIX is defined a multiplicative (Fibonacci) hash is used instead
+ * so that every bit of the NN and EN affects the hash. This avoids events 
+ * whose ENs differ by a multiple of EVENT_HASH_LENGTH sharing a chain.
+ * 
  * @param e the event
  * @return the hash
  */
 uint8_t getHash(uint16_t nn, uint16_t en) {
-    uint8_t hash;
-    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
-    hash = (uint8_t)(nn ^ (nn >> 8U));
-    hash = (uint8_t)(7U*hash + (en ^ (en>>8U))); 
-    // ensure it is within bounds of eventChains
-    hash %= EVENT_HASH_LENGTH;
-    return hash;
+#ifdef EVENT_HASH_MIX
+    return mixEventHash(nn, en, EVENT_HASH_LENGTH);
+#else
+    return xorEventHash(nn, en, EVENT_HASH_LENGTH);
+#endif
 }
- 
+
+
 /**
  * Initialise the RAM hash chain for reverse lookup of event to action. Uses the
  * data from the Flash Event2Action table.
@@ -1337,7 +2600,11 @@ void rebuildHashtable(void) {
     uint8_t hash;
     uint8_t chainIdx;
     uint8_t tableIndex;
+    uint16_t nodeNumber, eventNumber;
     int a;
+#ifdef EVENT_BLOOM_BITS
+    bloomClear();
+#endif
 #ifdef EVENT_PRODUCED_EVENT_HASH
     // first initialise to nothing
     Happening happening;
@@ -1350,6 +2617,17 @@ void rebuildHashtable(void) {
             eventChains[hash][chainIdx] = NO_INDEX;
         }
     }
+#ifdef EVENT_HASH_OVERFLOW
+    for (chainIdx=0; chainIdx < EVENT_HASH_OVERFLOW; chainIdx++) {
+        eventOverflow[chainIdx] = NO_INDEX;
+    }
+#endif
+    hashIncomplete = FALSE;
+#ifdef VLCB_DIAG
+    rebuildStart.val = tickGet();
+    teachDiagnostics[TEACH_DIAG_MAX_PROBE].asUint = 0;
+    teachDiagnostics[TEACH_DIAG_OVERFLOWED].asUint = 0;
+#endif
     // now scan the event2Action table and populate the hash and lookup tables
     
     for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
@@ -1377,18 +2655,174 @@ void rebuildHashtable(void) {
                 happening2Event[happening-HAPPENING_BASE] = tableIndex;
             } 
 #endif
-            hash = getHash(getNN(tableIndex), getEN(tableIndex));
-                
-            for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
-                if (eventChains[hash][chainIdx] == NO_INDEX) {
-                    // available
-                    eventChains[hash][chainIdx] = tableIndex;
+            nodeNumber = getNN(tableIndex);
+            eventNumber = getEN(tableIndex);
+#ifdef EVENT_BLOOM_BITS
+            bloomAdd(nodeNumber, eventNumber);
+#endif
+            insertHash(tableIndex, getHash(nodeNumber, eventNumber));
+        }
+    }
+#ifdef VLCB_DIAG
+    // record how well the events are spread across the chains
+    teachDiagnostics[TEACH_DIAG_LONGEST_CHAIN].asUint = 0;
+    teachDiagnostics[TEACH_DIAG_EMPTY_CHAINS].asUint = 0;
+    for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
+        for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+            if (eventChains[hash][chainIdx] == NO_INDEX) break;
+        }
+        if (chainIdx == 0) {
+            teachDiagnostics[TEACH_DIAG_EMPTY_CHAINS].asUint++;
+        }
+        if (teachDiagnostics[TEACH_DIAG_LONGEST_CHAIN].asUint < chainIdx) {
+            teachDiagnostics[TEACH_DIAG_LONGEST_CHAIN].asUint = chainIdx;
+        }
+    }
+    // a full chain may have had more events which didn't fit
+    if (teachDiagnostics[TEACH_DIAG_OVERFLOWED].asUint) {
+        teachDiagnostics[TEACH_DIAG_LONGEST_CHAIN].asUint = EVENT_CHAIN_LENGTH + 1;
+    }
+    teachDiagnostics[TEACH_DIAG_REBUILD_TIME].asUint = (uint16_t)(tickTimeSince(rebuildStart) / HUNDRED_MICRO_SECOND);
+#endif
+}
+
+/**
+ * Insert an event into the hash table. If the event's hash chain is full it is 
+ * put into the overflow area. If that is also full then findEvent() will 
+ * search the event table for events which are not in the hash table.
+ * 
+ * @param tableIndex the index of the start of the event
+ * @param hash the event's hash
+ */
+static void insertHash(uint8_t tableIndex, uint8_t hash) {
+    uint8_t chainIdx;
+    uint16_t probes;    // may exceed 255 when the event table is scanned
+    
+    probes = 0;
+    for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+        probes++;
+        if (eventChains[hash][chainIdx] == NO_INDEX) {
+            // available
+            eventChains[hash][chainIdx] = tableIndex;
+            break;
+        }
+    }
+#ifdef EVENT_HASH_OVERFLOW
+    if (chainIdx == EVENT_CHAIN_LENGTH) {
+#ifdef VLCB_DIAG
+        teachDiagnostics[TEACH_DIAG_OVERFLOWED].asUint++;
+#endif
+        for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+            probes++;
+            if (eventOverflow[chainIdx] == NO_INDEX) {
+                eventOverflow[chainIdx] = tableIndex;
+                break;
+            }
+        }
+        if (chainIdx == EVENT_HASH_OVERFLOW) {
+            hashIncomplete = TRUE;
+            probes += NUM_EVENTS;
+        }
+    }
+#else
+    if (chainIdx == EVENT_CHAIN_LENGTH) {
+#ifdef VLCB_DIAG
+        teachDiagnostics[TEACH_DIAG_OVERFLOWED].asUint++;
+#endif
+        hashIncomplete = TRUE;
+        probes += NUM_EVENTS;
+    }
+#endif
+#ifdef VLCB_DIAG
+    if (teachDiagnostics[TEACH_DIAG_MAX_PROBE].asUint < probes) {
+        teachDiagnostics[TEACH_DIAG_MAX_PROBE].asUint = probes;
+    }
+#endif
+}
+
+/**
+ * Add a newly created event to the RAM hash tables without rebuilding them.
+ * Used during a learn session. The happening2Event lookup is not updated 
+ * until the hash tables are rebuilt at the end of the session.
+ * 
+ * @param tableIndex the index of the start of the event
+ */
+static void addToHashtable(uint8_t tableIndex) {
+    uint16_t nodeNumber, eventNumber;
+    
+    nodeNumber = getNN(tableIndex);
+    eventNumber = getEN(tableIndex);
+#ifdef EVENT_BLOOM_BITS
+    bloomAdd(nodeNumber, eventNumber);
+#endif
+    insertHash(tableIndex, getHash(nodeNumber, eventNumber));
+}
+
+/**
+ * Remove an event from the RAM hash tables without rebuilding them.
+ * Used during a learn session. Must be called before the event is removed from
+ * the event table. Any Bloom filter bits are left set until the next rebuild.
+ * 
+ * @param tableIndex the index of the start of the event
+ */
+static void removeFromHashtable(uint8_t tableIndex) {
+    uint8_t hash;
+    uint8_t chainIdx;
+#ifdef EVENT_PRODUCED_EVENT_HASH
+    uint8_t h;
+    for (h=0; h<=(1+MAX_HAPPENING-HAPPENING_BASE); h++) {
+        if (happening2Event[h] == tableIndex) {
+            happening2Event[h] = NO_INDEX;
+        }
+    }
+#endif
+    hash = getHash(getNN(tableIndex), getEN(tableIndex));
+    for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+        if (eventChains[hash][chainIdx] == tableIndex) {
+            // shuffle the rest of the chain down so there are no gaps
+            for (; chainIdx<EVENT_CHAIN_LENGTH-1; chainIdx++) {
+                eventChains[hash][chainIdx] = eventChains[hash][chainIdx+1];
+            }
+            eventChains[hash][EVENT_CHAIN_LENGTH-1] = NO_INDEX;
+#ifdef EVENT_HASH_OVERFLOW
+            // move an overflowed event with the same hash back into the chain
+            for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+                uint8_t overflowIndex = eventOverflow[chainIdx];
+                if (overflowIndex == NO_INDEX) break;
+                if (getHash(getNN(overflowIndex), getEN(overflowIndex)) == hash) {
+                    eventChains[hash][EVENT_CHAIN_LENGTH-1] = overflowIndex;
+                    removeFromOverflow(chainIdx);
                     break;
                 }
             }
+#endif
+            return;
+        }
+    }
+#ifdef EVENT_HASH_OVERFLOW
+    for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+        if (eventOverflow[chainIdx] == tableIndex) {
+            removeFromOverflow(chainIdx);
+            return;
         }
     }
+#endif
+}
+
+#ifdef EVENT_HASH_OVERFLOW
+/**
+ * Remove an entry from the overflow area, shuffling the rest of the overflow
+ * area down so there are no gaps.
+ * 
+ * @param overflowIdx the index into the overflow area
+ */
+static void removeFromOverflow(uint8_t overflowIdx) {
+    for (; overflowIdx<EVENT_HASH_OVERFLOW-1; overflowIdx++) {
+        eventOverflow[overflowIdx] = eventOverflow[overflowIdx+1];
+    }
+    eventOverflow[EVENT_HASH_OVERFLOW-1] = NO_INDEX;
 }
+#endif
 
 #endif
 
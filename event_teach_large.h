@@ -37,6 +37,7 @@
 #include "xc.h"
 #include "module.h"
 #include "vlcb.h"
+#include "event_teach.h"
 
 /**
  * @file
@@ -51,6 +52,36 @@
  *
  * This generic code needs no knowledge of specific EV usage.
  * 
+ * # Module.h definitions
+ * - \#define EVENT_TABLE_WIDTH   Optional. The number of EVs stored in each row
+ *                       of the table. If not defined it is the most that fit
+ *                       in a row, 2, 10 or 25 for row widths of 8, 16 or 32 bytes.
+ * - \#define EVENTTABLE_ROW_WIDTH Optional. The number of bytes in each row of
+ *                       the table, 8, 16 or 32. Defaults to 16, which is the
+ *                       layout used by earlier versions of the library.
+ * - \#define EVENT_TABLE_SPLIT   Optional. Store the flags and events of all rows
+ *                       in a dense header region separate from the EVs. 
+ *                       EVENT_TABLE_WIDTH then defaults to PARAM_NUM_EV_EVENT.
+ *                       EVENTTABLE_SIZE bytes are needed at EVENT_TABLE_ADDRESS.
+ * - \#define EVENT_TABLE_LOG     Optional. Store the table as an append only log
+ *                       in flash, see eventLog.h. EVENT_TABLE_ADDRESS is 
+ *                       then not used.
+ * - \#define EVENT_RANGES        Optional. The number of range entries. Each
+ *                       matches a contiguous block of ENs of one NN and holds
+ *                       a single set of EVs, see addEventRange(). 
+ *                       EVENT_RANGES*EVENTRANGE_ROW_WIDTH bytes are needed 
+ *                       at EVENT_RANGE_ADDRESS.
+ * - \#define EVENT_RANGE_OFFSET_EVS Optional. The number of leading EVs of a 
+ *                       range to which the position of the EN within the 
+ *                       range is added, defaults to 1.
+ * - \#define EVENT_RANGE_HANDLES Optional. The number of indices for events 
+ *                       within ranges which may be in use at once, defaults 
+ *                       to 4. See findEvent().
+ *
+ * @warning
+ * Changing EVENT_TABLE_WIDTH, EVENTTABLE_ROW_WIDTH or EVENT_TABLE_SPLIT changes
+ * the layout of the event table in NVM. APP_NVM_VERSION must then be incremented so that the
+ * event table is cleared rather than being misinterpreted.
  */
 
 /**
@@ -70,6 +101,50 @@ typedef union
     uint8_t    asByte;       ///< Set to 0xFF for free entry, initially set to zero for entry in use, then producer flag set if required.
 } EventTableFlags;
 
+#ifndef EVENT_TABLE_SPLIT
+/*
+ * Total number of bytes in an EventTable row. This is a power of 2 so that rows
+ * never straddle a flash page and the address calculation is a shift. The 
+ * default of 16 keeps the layout of existing event tables, other widths must
+ * be chosen in module.h.
+ */
+#ifndef EVENTTABLE_ROW_WIDTH
+#define EVENTTABLE_ROW_WIDTH       16
+#endif
+#if (EVENTTABLE_ROW_WIDTH != 8) && (EVENTTABLE_ROW_WIDTH != 16) && (EVENTTABLE_ROW_WIDTH != 32)
+#error "EVENTTABLE_ROW_WIDTH must be 8, 16 or 32"
+#endif
+#elif defined(EVENTTABLE_ROW_WIDTH)
+#error "EVENTTABLE_ROW_WIDTH cannot be used with EVENT_TABLE_SPLIT"
+#endif
+
+/*
+ * The number of EVs stored in each row of the Event table. If not defined in
+ * module.h this is as many as fit in a row.
+ */
+#ifndef EVENT_TABLE_WIDTH
+#ifdef EVENT_TABLE_SPLIT
+#define EVENT_TABLE_WIDTH   PARAM_NUM_EV_EVENT
+#elif EVENTTABLE_ROW_WIDTH == 8
+#define EVENT_TABLE_WIDTH   2
+#elif EVENTTABLE_ROW_WIDTH == 16
+#define EVENT_TABLE_WIDTH   10
+#else
+#define EVENT_TABLE_WIDTH   25
+#endif
+#endif
+
+/*
+ * The 4 bit eVsUsed field in the flags can only count up to 15 EVs. Wider rows
+ * have an additional header byte to hold the number of EVs used.
+ */
+#if EVENT_TABLE_WIDTH > 15
+#if EVENT_TABLE_WIDTH > 255
+#error "EVENT_TABLE_WIDTH too large"
+#endif
+#define EVENTTABLE_EXTENDED_EVSUSED
+#endif
+
 /**
  * Defines a row within the Event table.
  * Each row consists of 1 byte of flags, an index into the table for the next
@@ -84,7 +159,10 @@ typedef struct {
     EventTableFlags flags;          ///< put first so could potentially use the Event bytes for EVs in subsequent rows.
     uint8_t next;                   ///< index to continuation also indicates if entry is free.
     Event event;                    ///< the NN and EN.
-    uint8_t evs[EVENT_TABLE_WIDTH]; ///< EVENT_TABLE_WIDTH is maximum of 15 as we have 4 bits of maxEvUsed.
+#ifdef EVENTTABLE_EXTENDED_EVSUSED
+    uint8_t eVsUsed;                ///< number of EVs used when EVENT_TABLE_WIDTH is more than 15.
+#endif
+    uint8_t evs[EVENT_TABLE_WIDTH]; ///< EVENT_TABLE_WIDTH is maximum of 15 unless EVENTTABLE_EXTENDED_EVSUSED.
 } EventTable;
 
 /** Byte index into an EventTable row to access the flags element.*/
@@ -95,10 +173,143 @@ typedef struct {
 #define EVENTTABLE_OFFSET_NN       2
 /** Byte index into an EventTable row to access the event en element.*/
 #define EVENTTABLE_OFFSET_EN       4
+#ifdef EVENTTABLE_EXTENDED_EVSUSED
+/** Byte index into an EventTable row to access the number of EVs used.*/
+#define EVENTTABLE_OFFSET_EVSUSED  6
+/** Byte index into an EventTable row to access the event variables.*/
+#define EVENTTABLE_OFFSET_EVS      7
+#else
 /** Byte index into an EventTable row to access the event variables.*/
 #define EVENTTABLE_OFFSET_EVS      6
-/** Total number of bytes in an EventTable row.*/
-#define EVENTTABLE_ROW_WIDTH       16
+#endif
+
+#ifdef EVENT_TABLE_LOG
+#ifdef EVENT_TABLE_SPLIT
+#error "EVENT_TABLE_LOG cannot be used with EVENT_TABLE_SPLIT"
+#endif
+/*
+ * The rows are held in the event log so addresses are relative to the start 
+ * of the table rather than being NVM addresses.
+ */
+#define EVENTTABLE_BASE            0
+#else
+#define EVENTTABLE_BASE            EVENT_TABLE_ADDRESS
+#endif
+
+#ifdef EVENT_TABLE_SPLIT
+/*
+ * Split layout. The flags, next, event and number of EVs used of every row are
+ * held together in a dense header region with EVENTTABLE_HEADER_WIDTH bytes per
+ * row. This is followed by a separate region holding EVENT_TABLE_WIDTH EVs per
+ * row. Scans of the flags and events only read the header region.
+ */
+/** Number of bytes per row in the header region.*/
+#define EVENTTABLE_HEADER_WIDTH    8
+/** Total number of bytes in an EventTable row within the header region.*/
+#define EVENTTABLE_ROW_WIDTH       EVENTTABLE_HEADER_WIDTH
+/** Address of the EV region.*/
+#define EVENTTABLE_EV_REGION       (EVENT_TABLE_ADDRESS + (uint24_t)EVENTTABLE_HEADER_WIDTH*NUM_EVENTS)
+/** Address of a header field of a row.*/
+#define EVENTTABLE_HEADER_ADDRESS(i, o)  (EVENT_TABLE_ADDRESS + EVENTTABLE_HEADER_WIDTH*(i) + (o))
+/** Address of an EV of a row.*/
+#define EVENTTABLE_EV_ADDRESS(i, e)      (EVENTTABLE_EV_REGION + EVENT_TABLE_WIDTH*(i) + (e))
+/** Total number of bytes of NVM used by the EventTable.*/
+#define EVENTTABLE_SIZE            ((uint24_t)(EVENTTABLE_HEADER_WIDTH + EVENT_TABLE_WIDTH)*NUM_EVENTS)
+
+#else
+#if EVENTTABLE_OFFSET_EVS + EVENT_TABLE_WIDTH > EVENTTABLE_ROW_WIDTH
+#error "EVENT_TABLE_WIDTH does not fit in EVENTTABLE_ROW_WIDTH, define EVENTTABLE_ROW_WIDTH as 32 in module.h"
+#endif
+/** Number of bytes before the EVs in a row.*/
+#define EVENTTABLE_HEADER_WIDTH    EVENTTABLE_OFFSET_EVS
+/** Address of a header field of a row.*/
+#define EVENTTABLE_HEADER_ADDRESS(i, o)  (EVENTTABLE_BASE + EVENTTABLE_ROW_WIDTH*(i) + (o))
+/** Address of an EV of a row.*/
+#define EVENTTABLE_EV_ADDRESS(i, e)      (EVENTTABLE_BASE + EVENTTABLE_ROW_WIDTH*(i) + EVENTTABLE_OFFSET_EVS + (e))
+/** Total number of bytes of NVM used by the EventTable.*/
+#define EVENTTABLE_SIZE            ((uint24_t)EVENTTABLE_ROW_WIDTH*NUM_EVENTS)
+#endif
+
+#ifdef EVENT_TABLE_LOG
+#include "eventLog.h"
+/** Read a byte of the EventTable.*/
+#define EVENTTABLE_READ(a)         readEventLog(a)
+/** Read a sequence of bytes within one row of the EventTable.*/
+#define EVENTTABLE_READ_BLOCK(a, b, l)  readEventLogBlock(a, b, l)
+/** Write a byte of the EventTable.*/
+#define EVENTTABLE_WRITE(a, v)     writeEventLog(a, v)
+/** Commit changes to the EventTable.*/
+#define EVENTTABLE_FLUSH()         flushEventLog()
+/** Request that changes to the EventTable are committed without blocking.*/
+#define EVENTTABLE_REQUEST_FLUSH(c) requestEventLogFlush(c)
+#else
+#include "nvm.h"
+/** Read a byte of the EventTable.*/
+#define EVENTTABLE_READ(a)         readNVM(EVENT_TABLE_NVM_TYPE, a)
+/** Read a sequence of bytes within one row of the EventTable.*/
+#define EVENTTABLE_READ_BLOCK(a, b, l)  readNVMBlock(EVENT_TABLE_NVM_TYPE, a, b, l)
+/** Write a byte of the EventTable.*/
+#define EVENTTABLE_WRITE(a, v)     writeNVM(EVENT_TABLE_NVM_TYPE, a, v)
+/** Commit changes to the EventTable.*/
+#define EVENTTABLE_FLUSH()         flushNVM(EVENT_TABLE_NVM_TYPE)
+/** Request that changes to the EventTable are committed, without blocking if in Flash.*/
+#define EVENTTABLE_REQUEST_FLUSH(c) requestNVMFlush(EVENT_TABLE_NVM_TYPE, c)
+#endif
+
+#ifdef EVENT_RANGES
+/*
+ * Each range entry consists of a flags byte, which is 0 if the entry is in use
+ * or 0xFF if it is free, the NN, the first and last EN of the range and the EVs.
+ * The range entries are held in NVM of type EVENT_TABLE_NVM_TYPE at 
+ * EVENT_RANGE_ADDRESS.
+ */
+/** Byte index into a range entry to access the flags.*/
+#define EVENTRANGE_OFFSET_FLAGS    0
+/** Byte index into a range entry to access the NN.*/
+#define EVENTRANGE_OFFSET_NN       1
+/** Byte index into a range entry to access the first EN of the range.*/
+#define EVENTRANGE_OFFSET_FIRST    3
+/** Byte index into a range entry to access the last EN of the range.*/
+#define EVENTRANGE_OFFSET_LAST     5
+/** Byte index into a range entry to access the event variables.*/
+#define EVENTRANGE_OFFSET_EVS      7
+/** Total number of bytes in a range entry.*/
+#define EVENTRANGE_ROW_WIDTH       (EVENTRANGE_OFFSET_EVS + PARAM_NUM_EV_EVENT)
+/** Address of a field of a range entry.*/
+#define EVENTRANGE_ADDRESS(r, o)   (EVENT_RANGE_ADDRESS + EVENTRANGE_ROW_WIDTH*(r) + (o))
+/** The index used by findEvent(), getEv() etc. for the first event of a range entry.*/
+#define EVENTRANGE_INDEX(r)        (NUM_EVENTS + (r))
+/** The index used by findEvent(), getEv() etc. for a range handle.*/
+#define EVENTRANGE_HANDLE_INDEX(h) (NUM_EVENTS + EVENT_RANGES + (h))
+
+#ifndef EVENT_RANGE_OFFSET_EVS
+#define EVENT_RANGE_OFFSET_EVS     1
+#endif
+#ifndef EVENT_RANGE_HANDLES
+#define EVENT_RANGE_HANDLES        4
+#endif
+#if EVENT_RANGE_HANDLES < 2
+#error "EVENT_RANGE_HANDLES must be at least 2"
+#endif
+#if NUM_EVENTS + EVENT_RANGES + EVENT_RANGE_HANDLES > 255
+#error "NUM_EVENTS + EVENT_RANGES + EVENT_RANGE_HANDLES must not be more than 255"
+#endif
+
+extern uint8_t addEventRange(uint16_t nodeNumber, uint16_t firstEvent, uint16_t lastEvent, uint8_t evNum, uint8_t evVal);
+#endif
+
+#define NUM_TEACH_DIAGNOSTICS 12     ///< The number of diagnostic values associated with this service
+#define TEACH_DIAG_FRAGMENTED         0x02 ///< Continuation rows not next to the previous row in their chain
+#define TEACH_DIAG_RELOCATED          0x03 ///< Continuation rows moved by compaction
+#define TEACH_DIAG_MAX_PROBE          0x04 ///< Most event table rows read to find an event using the hash table
+#define TEACH_DIAG_LONGEST_CHAIN      0x05 ///< Most events in one hash chain after the hash table was rebuilt
+#define TEACH_DIAG_EMPTY_CHAINS       0x06 ///< Number of empty hash chains after the hash table was rebuilt
+#define TEACH_DIAG_OVERFLOWED         0x07 ///< Number of events which did not fit in their hash chain
+#define TEACH_DIAG_LOOKUPS            0x08 ///< Number of calls to findEvent
+#define TEACH_DIAG_LOOKUP_ROWS        0x09 ///< Number of event table rows compared by findEvent
+#define TEACH_DIAG_REBUILD_TIME       0x0A ///< Time taken by the last hash table rebuild in units of 0.1ms
+#define TEACH_DIAG_CACHE_HITS         0x0B ///< Number of findEvent calls answered by the lookup cache
+#define TEACH_DIAG_CACHE_MISSES       0x0C ///< Number of findEvent calls not answered by the lookup cache
 
 extern Boolean validStart(uint8_t index);
 extern void checkRemoveTableEntry(uint8_t tableIndex);
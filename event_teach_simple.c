@@ -91,7 +91,25 @@
  * The number of table entries is defined by NUM_EVENTS.
  * The 'event' field contains the NN/EN of the event.
  * 
- * Unused entries in the table have the event.EN set to zero.
+ * Unused entries in the table have the event.EN set to zero. Removing an event
+ * only clears its EN, the rest of the row is initialised when it is reused. A
+ * RAM occupancy bitmap of the rows is loaded at power up and used to find free
+ * rows and to skip unused rows without reading the event table.
+ * 
+ * If EVENT_HASH_TABLE is defined then EVENT_BLOOM_BITS may also be defined in 
+ * module.h to the size (a power of 2, maximum 256) of a RAM Bloom filter. This 
+ * is populated by rebuildHashtable() and allows findEvent() to reject events 
+ * which have not been taught without reading the event table.
+ * 
+ * If an event's hash chain is full it is held in an overflow area of 
+ * EVENT_HASH_OVERFLOW entries, if defined in module.h. If that is also full 
+ * findEvent() searches the event table so every event can still be found.
+ * EVENT_HASH_MIX may be defined to use a hash which gives a better spread for
+ * regular patterns of NN and EN.
+ * 
+ * If EVENT_TABLE_SPLIT is defined in module.h then the events and flags of all
+ * rows are stored together ahead of the EVs of all rows, so that searching 
+ * the table reads fewer bytes. The table occupies the same number of bytes.
  */
 
 // forward definitions
@@ -125,6 +143,7 @@ static void doEvlrn(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, ui
 
 #ifdef VLCB_DIAG
 static DiagnosticVal * teachGetDiagnostic(uint8_t code);
+#define NUM_TEACH_DIAGNOSTICS 1      ///< The number of diagnostic values associated with this service
 /**
  * The diagnostic values supported by the MNS service.
  */
@@ -136,9 +155,44 @@ uint8_t errno;
 
 #ifdef EVENT_HASH_TABLE
 uint8_t eventChains[EVENT_HASH_LENGTH][EVENT_CHAIN_LENGTH];
+#ifdef EVENT_BLOOM_BITS
+uint8_t eventBloom[EVENT_BLOOM_BITS/8];
+#endif
+#ifdef EVENT_HASH_OVERFLOW
+/**
+ * Events whose hash chain is full.
+ */
+static uint8_t eventOverflow[EVENT_HASH_OVERFLOW];
 #endif
+/**
+ * Set if an event could not be added to the hash table so findEvent() must
+ * search the event table for events not in the hash table.
+ */
+static Boolean hashIncomplete;
+#else
+#ifdef EVENT_HASH_OVERFLOW
+#error "EVENT_HASH_OVERFLOW requires EVENT_HASH_TABLE"
+#endif
+#endif
+static uint8_t scanForEvent(uint16_t nodeNumber, uint16_t eventNumber);
+
+/**
+ * Lookup of bit masks so that we don't need a variable shift.
+ */
+const uint8_t teachBitMask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+/**
+ * Occupancy bitmap of the event table with one bit per row. A set bit means
+ * the row holds an event. This allows free rows to be found, and unused rows 
+ * to be skipped, without reading the event table.
+ */
+static uint8_t rowsInUse[(NUM_EVENTS+7)/8];
+/** Test whether a row of the event table holds an event. */
+#define ROW_IN_USE(i)       (rowsInUse[(i)>>3] & teachBitMask[(i)&7])
+static void loadRowsInUse(void);
+static uint8_t findFreeRow(void);
 
 static uint8_t timedResponseOpcode; // used to differentiate a timed response for reqev AND reval
+static uint8_t nerdIndex;           // the next row to be checked by the NERD response
 
 /*
  * Each row in the event table consists of:
@@ -152,6 +206,21 @@ static uint8_t timedResponseOpcode; // used to differentiate a timed response fo
 #define EVENTTABLE_OFFSET_ENL   3
 #define EVENTTABLE_OFFSET_FLAGS 4
 #define EVENTTABLE_OFFSET_EVS   5
+
+#ifdef EVENT_TABLE_SPLIT
+/*
+ * Split layout. The Event and flags of every row are held together in a dense 
+ * header region followed by a separate region holding the EVs of each row so
+ * that scans of the events only read the header region.
+ */
+#define EVENTTABLE_HEADER_WIDTH EVENTTABLE_OFFSET_EVS
+#define EVENTTABLE_EV_REGION    (EVENT_TABLE_ADDRESS + (uint24_t)EVENTTABLE_HEADER_WIDTH*NUM_EVENTS)
+#define EVENTTABLE_HEADER_ADDRESS(i, o)  (EVENT_TABLE_ADDRESS + EVENTTABLE_HEADER_WIDTH*(i) + (o))
+#define EVENTTABLE_EV_ADDRESS(i, e)      (EVENTTABLE_EV_REGION + PARAM_NUM_EV_EVENT*(i) + (e))
+#else
+#define EVENTTABLE_HEADER_ADDRESS(i, o)  (EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*(i) + (o))
+#define EVENTTABLE_EV_ADDRESS(i, e)      (EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*(i) + EVENTTABLE_OFFSET_EVS + (e))
+#endif
 // The flags
 #define EVENT_FLAG_DEFAULT      1
 
@@ -197,6 +266,7 @@ static void teachFactoryReset(void) {
 static void teachPowerUp(void) {
     uint8_t i;
 
+    loadRowsInUse();
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -384,13 +454,20 @@ static DiagnosticVal * teachGetDiagnostic(uint8_t index) {
 
 /**
  * Removes all events including default events.
+ * Only the EN of each row is cleared, as by removeTableEntry(), but the flash
+ * is flushed and the hash table rebuilt once at the end rather than per row.
  */
 void clearAllEvents(void) {
     uint8_t tableIndex;
 
     for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-        removeTableEntry(tableIndex);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENH), 0x00);
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENL), 0x00);
     }
+    for (tableIndex=0; tableIndex<sizeof(rowsInUse); tableIndex++) {
+        rowsInUse[tableIndex] = 0;
+    }
+    flushNVM(EVENT_TABLE_NVM_TYPE);
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -405,9 +482,7 @@ static void doNnevn(void) {
     uint8_t count = 0;
     uint8_t i;
     for (i=0; i<NUM_EVENTS; i++) {
-        uint16_t eventNumber;
-        eventNumber = getEN(i);
-        if (eventNumber == 0) {
+        if ( ! ROW_IN_USE(i)) {
             count++;
         }
     }
@@ -420,6 +495,7 @@ static void doNnevn(void) {
  * This sets things up so that timedResponse will do the right stuff.
  */
 static void doNerd(void) {
+    nerdIndex = 0;
     startTimedResponse(TIMED_RESPONSE_NERD, findServiceIndex(SERVICE_ID_OLD_TEACH), nerdCallback);
 }
 
@@ -432,16 +508,18 @@ static void doNerd(void) {
  */
 TimedResponseResult nerdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step){
     Word nodeNumber, eventNumber;
-    // The step is used to index through the event table
-    if (step >= NUM_EVENTS) {  // finished?
-        return TIMED_RESPONSE_RESULT_FINISHED;
-    }
-
-    eventNumber.word = getEN(step);
-    if (eventNumber.word != 0) {
-        nodeNumber.word = getNN(step);
-        sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(step));
+    // Skip over unused rows so that an event is sent at every step
+    for (;;) {
+        if (nerdIndex >= NUM_EVENTS) {  // finished?
+            return TIMED_RESPONSE_RESULT_FINISHED;
+        }
+        if (ROW_IN_USE(nerdIndex)) break;
+        nerdIndex++;
     }
+    eventNumber.word = getEN(nerdIndex);
+    nodeNumber.word = getNN(nerdIndex);
+    sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(nerdIndex));
+    nerdIndex++;
 
     return TIMED_RESPONSE_RESULT_NEXT;
 }
@@ -465,8 +543,14 @@ static void doNenrd(uint8_t index) {
 #endif
         return;
     }
-    nodeNumber = getNN(tableIndex);
-    eventNumber = getEN(tableIndex);
+    if (ROW_IN_USE(tableIndex)) {
+        nodeNumber = getNN(tableIndex);
+        eventNumber = getEN(tableIndex);
+    } else {
+        // the NN of an unused row is not cleared
+        nodeNumber = 0;
+        eventNumber = 0;
+    }
     sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber>>8, nodeNumber&0xFF, eventNumber>>8, eventNumber&0xFF, tableIndex);
 
 } // doNenrd
@@ -481,9 +565,7 @@ static void doRqevn(void) {
     uint8_t count = 0;
     uint8_t i;
     for (i=0; i<NUM_EVENTS; i++) {
-        uint16_t eventNumber;
-        eventNumber = getEN(i);
-        if (eventNumber != 0) {
+        if (ROW_IN_USE(i)) {
             count++;
         }
     }
@@ -707,21 +789,15 @@ uint8_t removeEvent(uint16_t nodeNumber, uint16_t eventNumber) {
  * @return error or 0 for success
  */
 static uint8_t removeTableEntry(uint8_t tableIndex) {
-    uint8_t i;
 #ifdef SAFETY
     if (tableIndex >= NUM_EVENTS) return CMDERR_INV_EV_IDX;
 #endif
-    // set the NN and EN to zero
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + EVENTTABLE_OFFSET_NNH, 0x00);
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + EVENTTABLE_OFFSET_NNL, 0x00);
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + EVENTTABLE_OFFSET_ENH, 0x00);
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + EVENTTABLE_OFFSET_ENL, 0x00);
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + EVENTTABLE_OFFSET_FLAGS, 0x00);
-        
-    for (i=0; i<PARAM_NUM_EV_EVENT; i++) {
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex + (EVENTTABLE_OFFSET_EVS + i), 0x00);
-    }
-    flushFlashBlock();
+    // Only the EN is set to zero to mark the row as unused. Clearing bits needs
+    // no flash erase. The NN, flags and EVs are reinitialised when the row is reused.
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENH), 0x00);
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENL), 0x00);
+    rowsInUse[tableIndex>>3] &= (uint8_t)~teachBitMask[tableIndex&7];
+    flushNVM(EVENT_TABLE_NVM_TYPE);
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -750,26 +826,24 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
     if (tableIndex == NO_INDEX) {
         errno = CMDERR_TOO_MANY_EVENTS;
         // didn't find the event so find an empty slot and create one
-        for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-            uint16_t en = getEN(tableIndex);
-            if (en == 0) {
-                uint8_t e;
-                // found a free slot, initialise it
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_NNL, nodeNumber&0xFF);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_NNH, nodeNumber>>8);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_ENL, eventNumber&0xFF);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_ENH, eventNumber>>8);
-                if (forceOwnNN) {
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, EVENT_FLAG_DEFAULT);
-                } else {
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, 0);
-                }
-                for (e = 0; e < EVENT_TABLE_WIDTH; e++) {   // in this case EVENT_TABLE_WIDTH == EVperEvt
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+e, EV_FILL);
-                }
-                errno = 0;
-                break;
+        tableIndex = findFreeRow();
+        if (tableIndex != NO_INDEX) {
+            uint8_t e;
+            // found a free slot, initialise it
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NNL), nodeNumber&0xFF);
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_NNH), nodeNumber>>8);
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENL), eventNumber&0xFF);
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENH), eventNumber>>8);
+            if (forceOwnNN) {
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), EVENT_FLAG_DEFAULT);
+            } else {
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_FLAGS), 0);
             }
+            for (e = 0; e < EVENT_TABLE_WIDTH; e++) {   // in this case EVENT_TABLE_WIDTH == EVperEvt
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_EV_ADDRESS(tableIndex, e), EV_FILL);
+            }
+            rowsInUse[tableIndex>>3] |= teachBitMask[tableIndex&7];
+            errno = 0;
         }
         if (errno) {
             return NO_INDEX;
@@ -782,7 +856,7 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
         return NO_INDEX;
     }
     // success
-    flushFlashBlock();
+    flushNVM(EVENT_TABLE_NVM_TYPE);
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -798,22 +872,57 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
  */
 uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
 #ifdef EVENT_HASH_TABLE
-    uint8_t hash = getHash(nodeNumber, eventNumber);
+    uint8_t hash;
     uint8_t chainIdx;
+#ifdef EVENT_BLOOM_BITS
+    // quick reject of events we have not been taught
+    if ( ! bloomMayContain(nodeNumber, eventNumber)) return NO_INDEX;
+#endif
+    hash = getHash(nodeNumber, eventNumber);
     for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
         uint8_t tableIndex = eventChains[hash][chainIdx];
         uint16_t nn, en;
-        if (tableIndex == NO_INDEX) return NO_INDEX;
+        if (tableIndex == NO_INDEX) break;
         nn = getNN(tableIndex);
         en = getEN(tableIndex);
         if ((nn == nodeNumber) && (en == eventNumber)) {
             return tableIndex;
         }
     }
+#ifdef EVENT_HASH_OVERFLOW
+    if (chainIdx == EVENT_CHAIN_LENGTH) {
+        // the chain is full so the event may be in the overflow area
+        for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+            uint8_t tableIndex = eventOverflow[chainIdx];
+            if (tableIndex == NO_INDEX) break;
+            if ((getNN(tableIndex) == nodeNumber) && (getEN(tableIndex) == eventNumber)) {
+                return tableIndex;
+            }
+        }
+    }
+#endif
+    if (hashIncomplete) {
+        return scanForEvent(nodeNumber, eventNumber);
+    }
+    return NO_INDEX;
 #else
+    return scanForEvent(nodeNumber, eventNumber);
+#endif
+}
+
+/**
+ * Find an event by searching the event table.
+ * 
+ * @param nodeNumber event NN
+ * @param eventNumber event EN
+ * @return index into event table or NO_INDEX if not present
+ */
+static uint8_t scanForEvent(uint16_t nodeNumber, uint16_t eventNumber) {
     uint8_t tableIndex;
     for (tableIndex=0; tableIndex < NUM_EVENTS; tableIndex++) {
-        uint16_t b = getEN(tableIndex);
+        uint16_t b;
+        if ( ! ROW_IN_USE(tableIndex)) continue;
+        b = getEN(tableIndex);
         if (b == eventNumber) {
             b = getNN(tableIndex);
             if (b == nodeNumber) {
@@ -821,7 +930,6 @@ uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
             }
         }
     }
-#endif
     return NO_INDEX;
 }
 
@@ -842,7 +950,7 @@ uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
     }
     
     // now write the EV
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evNum, evVal);
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_EV_ADDRESS(tableIndex, evNum), evVal);
     return 0;
 }
  
@@ -860,7 +968,7 @@ int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
     if (evNum >= PARAM_NUM_EV_EVENT) {
         return -CMDERR_INV_EV_IDX;
     }
-    return (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evNum);
+    return (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENTTABLE_EV_ADDRESS(tableIndex, evNum));
 }
 
 /**
@@ -885,14 +993,11 @@ uint8_t evs[PARAM_NUM_EV_EVENT];
  */
 uint8_t getEVs(uint8_t tableIndex) {
 
-    uint8_t evIdx;
     if (tableIndex >= NUM_EVENTS) {
         return CMDERR_INV_EN_IDX;
     }
 
-    for (evIdx=0; evIdx < PARAM_NUM_EV_EVENT; evIdx++) {
-        evs[evIdx] = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evIdx);
-    }
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENTTABLE_EV_ADDRESS(tableIndex, 0), evs, PARAM_NUM_EV_EVENT);
     return 0;
 }
 
@@ -904,20 +1009,17 @@ uint8_t getEVs(uint8_t tableIndex) {
  * @return the Node Number
  */
 uint16_t getNN(uint8_t tableIndex) {
-    uint16_t hi;
-    uint16_t lo;
-    uint8_t flags;
+    uint8_t header[EVENTTABLE_OFFSET_FLAGS+1];
     if (tableIndex >= NUM_EVENTS) {
         return CMDERR_INV_EN_IDX;
     }
     
-    flags = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-    if (flags & EVENT_FLAG_DEFAULT) {
+    // read the NN through to the flags in one go
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, 0), header, sizeof(header));
+    if (header[EVENTTABLE_OFFSET_FLAGS] & EVENT_FLAG_DEFAULT) {
         return nn.word;
     }
-    lo = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_NNL);
-    hi = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_NNH);
-    return lo | (hi << 8);
+    return header[EVENTTABLE_OFFSET_NNL] | ((uint16_t)header[EVENTTABLE_OFFSET_NNH] << 8);
 }
 
 /**
@@ -928,12 +1030,46 @@ uint16_t getNN(uint8_t tableIndex) {
  * @return the Event Number
  */
 uint16_t getEN(uint8_t tableIndex) {
-    uint16_t hi;
-    uint16_t lo;
+    uint8_t en[2];
     
-    lo = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_ENL);
-    hi = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_WIDTH*tableIndex+EVENTTABLE_OFFSET_ENH);
-    return lo | (hi << 8);
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENTTABLE_HEADER_ADDRESS(tableIndex, EVENTTABLE_OFFSET_ENH), en, 2);
+    return en[1] | ((uint16_t)en[0] << 8);     // ENH is stored before ENL
+}
+
+/**
+ * Load the occupancy bitmap from the event table. Rows with an EN of zero are unused.
+ */
+static void loadRowsInUse(void) {
+    uint8_t tableIndex;
+    for (tableIndex=0; tableIndex<sizeof(rowsInUse); tableIndex++) {
+        rowsInUse[tableIndex] = 0;
+    }
+    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        if (getEN(tableIndex) != 0) {
+            rowsInUse[tableIndex>>3] |= teachBitMask[tableIndex&7];
+        }
+    }
+}
+
+/**
+ * Find the first free row in the event table.
+ * Uses the occupancy bitmap so skips 8 rows at a time when they are all in use.
+ * 
+ * @return the index of a free row or NO_INDEX if there is none
+ */
+static uint8_t findFreeRow(void) {
+    uint16_t i = 0;     // 16 bit so it cannot wrap when skipping a whole byte
+    while (i < NUM_EVENTS) {
+        if (((i & 7) == 0) && (rowsInUse[i>>3] == 0xFF)) {
+            i += 8;
+            continue;
+        }
+        if ( ! ROW_IN_USE(i)) {
+            return (uint8_t)i;
+        }
+        i++;
+    }
+    return NO_INDEX;
 }
 
 /**
@@ -978,20 +1114,22 @@ static uint8_t tableIndexToEvtIdx(uint8_t tableIndex) {
  * This also means that for layouts using the default FLiM node numbers from 256, 
  * we are effectively starting from zero as far as the hash algorithm is concerned.
  * 
+ * If EVENT_HASH_MIX is defined a multiplicative (Fibonacci) hash is used instead
+ * so that every bit of the NN and EN affects the hash.
+ * 
  * @param e the event
  * @return the hash
  */
 uint8_t getHash(uint16_t nn, uint16_t en) {
-    uint8_t hash;
-    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
-    hash = (uint8_t)(nn ^ (nn >> 8U));
-    hash = (uint8_t)(7U*hash + (en ^ (en>>8U))); 
-    // ensure it is within bounds of eventChains
-    hash %= EVENT_HASH_LENGTH;
-    return hash;
+#ifdef EVENT_HASH_MIX
+    return mixEventHash(nn, en, EVENT_HASH_LENGTH);
+#else
+    return xorEventHash(nn, en, EVENT_HASH_LENGTH);
+#endif
 }
 
 
+
 /**
  * Initialise the RAM hash chain for reverse lookup of event to tableIndex.
  */
@@ -1000,20 +1138,35 @@ void rebuildHashtable(void) {
     uint8_t hash;
     uint8_t chainIdx;
     uint8_t tableIndex;
+    uint16_t nodeNumber, eventNumber;
     int a;
 
+#ifdef EVENT_BLOOM_BITS
+    bloomClear();
+#endif
     for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
         for (chainIdx=0; chainIdx < EVENT_CHAIN_LENGTH; chainIdx++) {
             eventChains[hash][chainIdx] = NO_INDEX;
         }
     }
+#ifdef EVENT_HASH_OVERFLOW
+    for (chainIdx=0; chainIdx < EVENT_HASH_OVERFLOW; chainIdx++) {
+        eventOverflow[chainIdx] = NO_INDEX;
+    }
+#endif
+    hashIncomplete = FALSE;
     // now scan the event2Action table and populate the hash and lookup tables
     for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-        if (getEN(tableIndex) != 0) {
+        if (ROW_IN_USE(tableIndex)) {
             int16_t ev;
     
             // found the start of an event definition
-            hash = getHash(getNN(tableIndex), getEN(tableIndex));            
+            eventNumber = getEN(tableIndex);
+            nodeNumber = getNN(tableIndex);
+#ifdef EVENT_BLOOM_BITS
+            bloomAdd(nodeNumber, eventNumber);
+#endif
+            hash = getHash(nodeNumber, eventNumber);
             for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
                 if (eventChains[hash][chainIdx] == NO_INDEX) {
                     // available
@@ -1021,6 +1174,22 @@ void rebuildHashtable(void) {
                     break;
                 }
             }
+            if (chainIdx == EVENT_CHAIN_LENGTH) {
+#ifdef EVENT_HASH_OVERFLOW
+                // chain is full so use the overflow area
+                for (chainIdx=0; chainIdx<EVENT_HASH_OVERFLOW; chainIdx++) {
+                    if (eventOverflow[chainIdx] == NO_INDEX) {
+                        eventOverflow[chainIdx] = tableIndex;
+                        break;
+                    }
+                }
+                if (chainIdx == EVENT_HASH_OVERFLOW) {
+                    hashIncomplete = TRUE;
+                }
+#else
+                hashIncomplete = TRUE;
+#endif
+            }
         }
     }
 }
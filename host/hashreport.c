@@ -0,0 +1,215 @@
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * @brief
+ * Host tool to help choose EVENT_HASH_LENGTH and EVENT_CHAIN_LENGTH.
+ * @details
+ * Loads the event table from an image, or teaches a synthetic set of events,
+ * using event_teach_large.c with the event table and hash table options in 
+ * module.h. The hash table is then rebuilt with rebuildHashtable() and every
+ * event is looked up with findEvent(), counting the NVM reads made through the
+ * host NVM emulation.
+ * 
+ * The image is given by the NVM_IMAGE environment variable. Synthetic events
+ * are taught into a new image, hashreport.img.
+ * 
+ * Usage:
+ * - hashreport               the events in the image
+ * - hashreport long N        N long events of one NN with sequential ENs
+ * - hashreport nodes N       N long events, 4 ENs from each of many NNs
+ * - hashreport short N       N short events with sequential device numbers
+ * 
+ * The report gives the teach diagnostics from the rebuild, the NVM reads made
+ * by the rebuild and the time it took on the host, and the average and most 
+ * event table rows and NVM reads per findEvent(). Other EVENT_HASH_LENGTH and 
+ * EVENT_CHAIN_LENGTH values, or EVENT_HASH_MIX, can be tried by rebuilding, 
+ * for example:
+ * 
+ *     make clean hashreport CFLAGS="-O2 -DEVENT_HASH_LENGTH=64 -DEVENT_CHAIN_LENGTH=8"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nvm.h"
+#include "nvm_host.h"
+#include "event_teach_large.h"
+
+/** The image used for synthetic events.*/
+#define SYNTHETIC_IMAGE "hashreport.img"
+
+/**
+ * Teach a synthetic set of events into a new image.
+ * @param pattern long, nodes or short
+ * @param count the number of events
+ * @return 0 for success or 1 if the pattern is not known or an event could not be taught
+ */
+static int makeEvents(const char * pattern, uint16_t count) {
+    uint16_t i;
+    uint16_t nodeNumber;
+    uint16_t eventNumber;
+    
+    if (count > NUM_EVENTS) {
+        count = NUM_EVENTS;
+    }
+    remove(SYNTHETIC_IMAGE);
+    setenv("NVM_IMAGE", SYNTHETIC_IMAGE, 1);
+    initRomOps();
+    eventTeachService.factoryReset();
+    for (i=0; i<count; i++) {
+        if (strcmp(pattern, "long") == 0) {
+            nodeNumber = 256;
+            eventNumber = i+1;
+        } else if (strcmp(pattern, "nodes") == 0) {
+            nodeNumber = 256 + i/4;
+            eventNumber = i%4 + 1;
+        } else if (strcmp(pattern, "short") == 0) {
+            nodeNumber = 0;
+            eventNumber = i+1;
+        } else {
+            return 1;
+        }
+        if (addEvent(nodeNumber, eventNumber, 0, 1, FALSE)) {
+            fprintf(stderr, "could not teach event %u:%u\n", nodeNumber, eventNumber);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return a teach diagnostic value.
+ * @param code the diagnostic
+ * @return the value
+ */
+static uint16_t teachDiagnostic(uint8_t code) {
+    return eventTeachService.getDiagnostic(code)->asUint;
+}
+
+/**
+ * Return the number of NVM reads made so far.
+ * @return the Flash and EEPROM reads
+ */
+static uint32_t nvmReads(void) {
+    return hostNvmStats.flashReads + hostNvmStats.eepromReads;
+}
+
+int main(int argc, char * argv[]) {
+    static uint16_t nodeNumbers[NUM_EVENTS];
+    static uint16_t eventNumbers[NUM_EVENTS];
+    static uint8_t tableIndices[NUM_EVENTS];
+    uint16_t numEvents = 0;
+    uint16_t notFound = 0;
+    uint16_t i;
+    uint8_t tableIndex;
+    uint32_t reads;
+    uint32_t lookupReads = 0;
+    uint32_t mostReads = 0;
+    uint16_t lookups;
+    uint16_t lookupRows;
+    struct timespec start;
+    struct timespec end;
+    
+    if (argc == 3) {
+        if (makeEvents(argv[1], (uint16_t)atoi(argv[2]))) {
+            fprintf(stderr, "usage: %s [long|nodes|short count]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    } else if (argc == 1) {
+        initRomOps();
+    } else {
+        fprintf(stderr, "usage: %s [long|nodes|short count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    eventTeachService.powerUp();
+    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        if (validStart(tableIndex)) {
+            nodeNumbers[numEvents] = getNN(tableIndex);
+            eventNumbers[numEvents] = getEN(tableIndex);
+            tableIndices[numEvents] = tableIndex;
+            numEvents++;
+        }
+    }
+    
+    hostNvmResetStats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rebuildHashtable();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    reads = nvmReads();
+    printf("%u events, EVENT_HASH_LENGTH %u EVENT_CHAIN_LENGTH %u%s\n", numEvents, 
+            EVENT_HASH_LENGTH, EVENT_CHAIN_LENGTH,
+#ifdef EVENT_HASH_MIX
+            " EVENT_HASH_MIX"
+#else
+            ""
+#endif
+            );
+    printf("longest chain %u, empty chains %u, overflowed %u, most probes %u\n",
+            teachDiagnostic(TEACH_DIAG_LONGEST_CHAIN), teachDiagnostic(TEACH_DIAG_EMPTY_CHAINS),
+            teachDiagnostic(TEACH_DIAG_OVERFLOWED), teachDiagnostic(TEACH_DIAG_MAX_PROBE));
+    // TEACH_DIAG_REBUILD_TIME is too coarse for the host so time it here
+    printf("rebuild %lu NVM reads, %.0f us on the host\n", (unsigned long)reads,
+            (end.tv_sec - start.tv_sec)*1e6 + (end.tv_nsec - start.tv_nsec)/1e3);
+    
+    lookups = teachDiagnostic(TEACH_DIAG_LOOKUPS);
+    lookupRows = teachDiagnostic(TEACH_DIAG_LOOKUP_ROWS);
+    for (i=0; i<numEvents; i++) {
+        reads = nvmReads();
+        if (findEvent(nodeNumbers[i], eventNumbers[i]) != tableIndices[i]) {
+            notFound++;
+        }
+        reads = nvmReads() - reads;
+        lookupReads += reads;
+        if (reads > mostReads) {
+            mostReads = reads;
+        }
+    }
+    lookups = teachDiagnostic(TEACH_DIAG_LOOKUPS) - lookups;
+    lookupRows = teachDiagnostic(TEACH_DIAG_LOOKUP_ROWS) - lookupRows;
+    if (lookups) {
+        printf("findEvent %.2f rows and %.2f NVM reads on average, at most %lu reads\n",
+                (double)lookupRows/lookups, (double)lookupReads/lookups, (unsigned long)mostReads);
+    }
+    printf("hash table RAM %u bytes\n", EVENT_HASH_LENGTH*EVENT_CHAIN_LENGTH);
+    if (teachDiagnostic(TEACH_DIAG_OVERFLOWED)) {
+        printf("some events do not fit in their chain, increase EVENT_CHAIN_LENGTH or EVENT_HASH_LENGTH\n");
+    } else {
+        printf("every event fits in its chain\n");
+    }
+    if (notFound) {
+        printf("%u events were not found\n", notFound);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * @brief
+ * The functions of the VLCB core, MNS service and application which 
+ * event_teach_large.c calls, for the host programs which use the event table.
+ * @details
+ * Messages are not sent anywhere. The host programs call addEvent(), 
+ * findEvent() etc. directly rather than passing messages to the service.
+ */
+
+#include "vlcb.h"
+#include "mns.h"
+#include "timedResponse.h"
+#include "event_teach.h"
+
+Word nn;
+uint8_t mode_flags;
+
+uint8_t APP_addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8_t evVal, Boolean forceOwnNN) {
+    return addEvent(nodeNumber, eventNumber, evNum, evVal, forceOwnNN);
+}
+
+Processed checkLen(Message * m, uint8_t needed, uint8_t service) {
+    return (m->len < needed) ? PROCESSED : NOT_PROCESSED;
+}
+
+uint8_t findServiceIndex(uint8_t id) {
+    return 0;
+}
+
+void sendMessage2(VlcbOpCodes opc, uint8_t data1, uint8_t data2) {
+}
+
+void sendMessage3(VlcbOpCodes opc, uint8_t data1, uint8_t data2, uint8_t data3) {
+}
+
+void sendMessage5(VlcbOpCodes opc, uint8_t data1, uint8_t data2, uint8_t data3, uint8_t data4, uint8_t data5) {
+}
+
+void sendMessage6(VlcbOpCodes opc, uint8_t data1, uint8_t data2, uint8_t data3, uint8_t data4, uint8_t data5, uint8_t data6) {
+}
+
+void sendMessage7(VlcbOpCodes opc, uint8_t data1, uint8_t data2, uint8_t data3, uint8_t data4, uint8_t data5, uint8_t data6, uint8_t data7) {
+}
+
+uint8_t timedResponseInProgress(void) {
+    return 0;
+}
+
+void startTimedResponse(uint8_t type, uint8_t serviceIndex, TimedResponseResult (*callback)(uint8_t type, uint8_t si, uint8_t step)) {
+}
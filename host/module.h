@@ -0,0 +1,72 @@
+#ifndef _MODULE_H_
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+#define _MODULE_H_
+
+/**
+ * @file
+ * @brief
+ * Module definitions for the host build of the NVM driver.
+ * @details
+ * Selects the host emulation of Flash and EEPROM and the NVM options exercised
+ * by nvmtest.c. Other options may be added here, or on the make command line 
+ * with CFLAGS, to try them on the host.
+ * 
+ * The event table definitions are used by event_teach_large.c in hashreport
+ * to read an image of a module's event table so should be copied from that 
+ * module's module.h. EVENT_HASH_LENGTH and EVENT_CHAIN_LENGTH may be given on
+ * the make command line.
+ */
+
+#define NVM_HOST
+#define HOST_NVM_IMAGE          "nvmtest.img"
+
+#define FLASH_CACHE_PAGES       2
+#define EEPROM_SHADOW_ADDRESS   0x300
+#define EEPROM_SHADOW_SIZE      16
+#define VLCB_DIAG
+
+#define NUM_EVENTS              255
+#define PARAM_NUM_EV_EVENT      20
+#define EVENT_TABLE_ADDRESS     0xC000
+#define EVENT_TABLE_NVM_TYPE    FLASH_NVM_TYPE
+#define EVENT_HASH_TABLE
+#ifndef EVENT_HASH_LENGTH
+#define EVENT_HASH_LENGTH       32
+#endif
+#ifndef EVENT_CHAIN_LENGTH
+#define EVENT_CHAIN_LENGTH      20
+#endif
+#define EVperEVT                PARAM_NUM_EV_EVENT
+#define HAPPENING_SIZE          1
+
+#endif
@@ -0,0 +1,87 @@
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * @brief
+ * Host test of the NVM driver.
+ * @details
+ * Builds nvm.c with the host emulation in nvm_host.c, writes a pattern to Flash
+ * and EEPROM through the NVM API, checks that it reads back from the image and
+ * prints the counts of erases and writes. The exit status is non zero if any
+ * byte did not read back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "nvm.h"
+#include "nvm_host.h"
+
+#define TEST_FLASH_ADDRESS  0x8000  ///< start of the Flash written by the test
+#define TEST_FLASH_LENGTH   (3*FLASH_PAGE_SIZE+10)
+#define TEST_EEPROM_ADDRESS 0x2F8   ///< overlaps the start of the shadowed EEPROM
+#define TEST_EEPROM_LENGTH  24
+
+int main(void) {
+    uint16_t i;
+    uint16_t bad = 0;
+    uint8_t block[40];
+    
+    initRomOps();
+    for (i=0; i<TEST_FLASH_LENGTH; i++) {
+        writeNVM(FLASH_NVM_TYPE, TEST_FLASH_ADDRESS+i, (uint8_t)(i+1));
+    }
+    flushFlashBlock();
+    for (i=0; i<TEST_FLASH_LENGTH; i++) {
+        if (hostFlashRead(TEST_FLASH_ADDRESS+i) != (uint8_t)(i+1)) bad++;
+    }
+    readNVMBlock(FLASH_NVM_TYPE, TEST_FLASH_ADDRESS+FLASH_PAGE_SIZE-20, block, sizeof(block));
+    for (i=0; i<sizeof(block); i++) {
+        if (block[i] != (uint8_t)(FLASH_PAGE_SIZE-20+i+1)) bad++;
+    }
+    fillNVM(FLASH_NVM_TYPE, TEST_FLASH_ADDRESS, 0xFF, TEST_FLASH_LENGTH);
+    flushFlashBlock();
+    for (i=0; i<TEST_FLASH_LENGTH; i++) {
+        if (hostFlashRead(TEST_FLASH_ADDRESS+i) != 0xFF) bad++;
+    }
+    
+    for (i=0; i<TEST_EEPROM_LENGTH; i++) {
+        writeNVM(EEPROM_NVM_TYPE, TEST_EEPROM_ADDRESS+i, (uint8_t)(0x80+i));
+    }
+    flushEepromQueue();
+    for (i=0; i<TEST_EEPROM_LENGTH; i++) {
+        if (hostEepromRead(TEST_EEPROM_ADDRESS+i) != (uint8_t)(0x80+i)) bad++;
+    }
+    
+    hostNvmReport(stdout);
+    printf("%u bytes did not read back\n", bad);
+    return (bad == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,249 @@
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * @brief
+ * Host test of the event table lookup.
+ * @details
+ * Builds event_teach_large.c with the host NVM emulation and the event table
+ * and hash table options in module.h. Sets of events with sequential ENs, with
+ * ENs at a stride which puts them all in one hash chain, and from many NNs are
+ * taught and each event must then be found by findEvent(), whether from its 
+ * hash chain, the overflow area or the scan made when the hash table is 
+ * incomplete. The sets are taught both directly, with the hash table rebuilt
+ * afterwards, and by EVLRN in a learn session, where the events are added to 
+ * the hash table as they are taught.
+ * 
+ * TEACH_DIAG_MAX_PROBE is checked against the bound for the chains, overflow 
+ * area and scan which were used. The exit status is non zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vlcb.h"
+#include "mns.h"
+#include "nvm.h"
+#include "event_teach_large.h"
+
+#ifdef EVENT_HASH_OVERFLOW
+#define OVERFLOW_LENGTH     EVENT_HASH_OVERFLOW
+#else
+#define OVERFLOW_LENGTH     0
+#endif
+
+/** The sets of events taught.*/
+typedef enum {
+    SEQUENTIAL_EN,  ///< one NN with ENs 1, 2, 3...
+    STRIDED_EN,     ///< one NN with ENs 257 apart, which all have the same hash
+    MANY_NN         ///< EN 1 of NNs 1, 2, 3...
+} EventSet;
+#define NUM_SETS    3
+
+static const char * const setNames[NUM_SETS] = {"sequential EN", "strided EN", "many NN"};
+
+/**
+ * The number of events taught from each set. A part filled table lets some 
+ * events use the overflow area without the hash table becoming incomplete.
+ */
+static const uint16_t setSizes[] = {140, NUM_EVENTS};
+#define NUM_SIZES   (sizeof(setSizes)/sizeof(setSizes[0]))
+
+/** The value taught to the first EV of an event, which must not be EV_FILL.*/
+#define EV_VALUE(i)     ((uint8_t)((i)%200 + 1))
+
+/**
+ * Return the NN and EN of an event of a set.
+ * @param set the set
+ * @param i the event number within the set
+ * @param nodeNumber set to the NN
+ * @param eventNumber set to the EN
+ */
+static void setEvent(EventSet set, uint16_t i, uint16_t * nodeNumber, uint16_t * eventNumber) {
+    switch (set) {
+        case SEQUENTIAL_EN:
+            *nodeNumber = 256;
+            *eventNumber = i+1;
+            break;
+        case STRIDED_EN:
+            *nodeNumber = 256;
+            *eventNumber = 257*(i+1);
+            break;
+        default:
+            *nodeNumber = i+1;
+            *eventNumber = 1;
+            break;
+    }
+}
+
+/**
+ * Return a teach diagnostic value.
+ * @param code the diagnostic
+ * @return the value
+ */
+static uint16_t teachDiagnostic(uint8_t code) {
+    return eventTeachService.getDiagnostic(code)->asUint;
+}
+
+/**
+ * Teach an event by EVLRN in learn mode.
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @param evVal the value of the first EV
+ */
+static void evlrn(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evVal) {
+    Message m;
+    
+    m.opc = OPC_EVLRN;
+    m.len = 7;
+    m.bytes[0] = nodeNumber >> 8;
+    m.bytes[1] = nodeNumber & 0xFF;
+    m.bytes[2] = eventNumber >> 8;
+    m.bytes[3] = eventNumber & 0xFF;
+    m.bytes[4] = 1;
+    m.bytes[5] = evVal;
+    eventTeachService.processMessage(&m);
+    pollNVM();
+}
+
+/**
+ * Check that every event of a set can be found and has the EV it was taught.
+ * @param set the set
+ * @param count the number of events taught
+ * @return the number of failures
+ */
+static uint16_t checkFound(EventSet set, uint16_t count) {
+    uint16_t i;
+    uint16_t nodeNumber;
+    uint16_t eventNumber;
+    uint8_t tableIndex;
+    uint16_t bad = 0;
+    
+    for (i=0; i<count; i++) {
+        setEvent(set, i, &nodeNumber, &eventNumber);
+        tableIndex = findEvent(nodeNumber, eventNumber);
+        if ((tableIndex >= NUM_EVENTS) || (getNN(tableIndex) != nodeNumber) || 
+                (getEN(tableIndex) != eventNumber) || (getEv(tableIndex, 0) != EV_VALUE(i))) {
+            printf("  %s event %u:%u not found\n", setNames[set], nodeNumber, eventNumber);
+            bad++;
+        }
+    }
+    // one more than was taught must not be found
+    setEvent(set, count, &nodeNumber, &eventNumber);
+    if (findEvent(nodeNumber, eventNumber) != 0xFF) {
+        printf("  %s event %u:%u found but not taught\n", setNames[set], nodeNumber, eventNumber);
+        bad++;
+    }
+    return bad;
+}
+
+/**
+ * Check TEACH_DIAG_MAX_PROBE after the hash table has been rebuilt. Events in
+ * their chain take at most EVENT_CHAIN_LENGTH probes and those in the overflow
+ * area at most EVENT_HASH_OVERFLOW more. Any other event is found by the scan 
+ * of the event table, which adds NUM_EVENTS.
+ * @param set the set
+ * @return the number of failures
+ */
+static uint16_t checkProbes(EventSet set) {
+    uint16_t overflowed = teachDiagnostic(TEACH_DIAG_OVERFLOWED);
+    uint16_t maxProbe = teachDiagnostic(TEACH_DIAG_MAX_PROBE);
+    uint16_t low = 1;
+    uint16_t high = EVENT_CHAIN_LENGTH;
+    
+    if (overflowed > OVERFLOW_LENGTH) {
+        low = EVENT_CHAIN_LENGTH + OVERFLOW_LENGTH + 1;
+        high = EVENT_CHAIN_LENGTH + OVERFLOW_LENGTH + NUM_EVENTS;
+    } else if (overflowed > 0) {
+        low = EVENT_CHAIN_LENGTH + 1;
+        high = EVENT_CHAIN_LENGTH + OVERFLOW_LENGTH;
+    }
+    printf("  %s overflowed %u most probes %u\n", setNames[set], overflowed, maxProbe);
+    if ((maxProbe < low) || (maxProbe > high)) {
+        printf("  %s most probes %u should be %u to %u\n", setNames[set], maxProbe, low, high);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    EventSet set;
+    uint8_t size;
+    uint16_t count;
+    uint16_t i;
+    uint16_t nodeNumber;
+    uint16_t eventNumber;
+    uint16_t bad = 0;
+    
+    initRomOps();
+    nn.word = 1000;
+    eventTeachService.powerUp();
+    printf("EVENT_HASH_LENGTH %u EVENT_CHAIN_LENGTH %u overflow %u\n", 
+            EVENT_HASH_LENGTH, EVENT_CHAIN_LENGTH, OVERFLOW_LENGTH);
+    for (size=0; size<NUM_SIZES; size++) {
+        count = setSizes[size];
+        printf("%u events\n", count);
+        for (set=0; set<NUM_SETS; set++) {
+            // taught directly with the hash table rebuilt after each event
+            eventTeachService.factoryReset();
+            for (i=0; i<count; i++) {
+                setEvent(set, i, &nodeNumber, &eventNumber);
+                if (addEvent(nodeNumber, eventNumber, 0, EV_VALUE(i), FALSE)) {
+                    printf("  %s event %u:%u not taught\n", setNames[set], nodeNumber, eventNumber);
+                    bad++;
+                }
+            }
+            bad += checkFound(set, count);
+            bad += checkProbes(set);
+
+            // taught in a learn session, the hash table is rebuilt when it ends
+            eventTeachService.factoryReset();
+            mode_flags |= FLAG_MODE_LEARN;
+            for (i=0; i<count; i++) {
+                setEvent(set, i, &nodeNumber, &eventNumber);
+                evlrn(nodeNumber, eventNumber, EV_VALUE(i));
+            }
+            bad += checkFound(set, count);
+            mode_flags &= ~FLAG_MODE_LEARN;
+            eventTeachService.poll();
+            bad += checkFound(set, count);
+            bad += checkProbes(set);
+
+            // and found again after power up
+            flushFlashBlock();
+            eventTeachService.powerUp();
+            bad += checkFound(set, count);
+        }
+    }
+    printf("%u checks failed\n", bad);
+    return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#ifndef _XC_H_
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+#define _XC_H_
+
+/**
+ * @file
+ * @brief
+ * Replacement for XC8's xc.h for host builds.
+ * @details
+ * Only the definitions needed to compile nvm.c with NVM_HOST are provided. The
+ * PIC registers are not declared as nvm.c does not use them in a host build.
+ * The device family is chosen with -D_18F66K80_FAMILY_ or -D_18FXXQ83_FAMILY_
+ * on the compiler command line, as XC8 would do from the selected device.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** XC8 provides a 24 bit integer for program memory addresses.*/
+typedef uint32_t uint24_t;
+
+#if defined(_18F66K80_FAMILY_)
+#define _FLASH_ERASE_SIZE   64      ///< Bytes erased at once
+#endif
+
+#endif
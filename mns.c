@@ -482,6 +482,8 @@ static Processed mnsProcessMessage(Message * m) {
                 sendMessage2(OPC_NNREL, previousNN.bytes.hi, previousNN.bytes.lo);
                 transport->waitForTxQueueToDrain();
             }
+            flushFlashBlock();
+            flushEepromQueue();
             RESET();
 #ifdef VLCB_DIAG
         case OPC_RDGN:  // diagnostics
@@ -594,6 +596,8 @@ static Processed mnsProcessMessage(Message * m) {
             return NOT_PROCESSED;
 #endif
         case OPC_NNRST: // reset CPU
+            flushFlashBlock();
+            flushEepromQueue();
             RESET();
             return PROCESSED;   // should never get here
         default:
@@ -665,6 +669,10 @@ static void mnsPoll(void) {
     
     // Update mode if app or any service has changed them
     if (mode_flags != last_mode_flags) {
+        if ((last_mode_flags & FLAG_MODE_LEARN) && !(mode_flags & FLAG_MODE_LEARN)) {
+            // learning finished so save what was taught
+            requestFlashFlush(NULL);
+        }
         writeNVM(MODE_FLAGS_NVM_TYPE, MODE_FLAGS_ADDRESS, mode_flags);
         last_mode_flags = mode_flags;
     }
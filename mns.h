@@ -111,7 +111,13 @@
 extern const Service mnsService;
 
 /* The list of the diagnostics supported */
+#if defined(FLASH_WEAR_PAGES)
+#define NUM_MNS_DIAGNOSTICS 13  ///< The number of diagnostic values for this service
+#elif defined(EEPROM_WRITE_QUEUE)
+#define NUM_MNS_DIAGNOSTICS 8   ///< The number of diagnostic values for this service
+#else
 #define NUM_MNS_DIAGNOSTICS 6   ///< The number of diagnostic values for this service
+#endif
 #define MNS_DIAGNOSTICS_COUNT       0x00    ///< The a series of DGN messages for each services? supported data.
 #define MNS_DIAGNOSTICS_STATUS      0x01    ///< The Global status Byte.
 #define MNS_DIAGNOSTICS_UPTIMEH     0x02    ///< The uptime upper word.
@@ -119,6 +125,13 @@ extern const Service mnsService;
 #define MNS_DIAGNOSTICS_MEMERRS     0x04    ///< The memory status.
 #define MNS_DIAGNOSTICS_NNCHANGE    0x05    ///< The number of Node Number changes.
 #define MNS_DIAGNOSTICS_RXMESS      0x06    ///< The number of received messages acted upon.
+#define MNS_DIAGNOSTICS_EEQUEUE     0x07    ///< The most EEPROM writes queued at once (EEPROM_WRITE_QUEUE only).
+#define MNS_DIAGNOSTICS_EEFAILS     0x08    ///< The number of queued EEPROM writes abandoned after retries (EEPROM_WRITE_QUEUE only).
+#define MNS_DIAGNOSTICS_FLASHERASES 0x09    ///< The number of flash page erases (FLASH_WEAR_PAGES only).
+#define MNS_DIAGNOSTICS_FLASHWRITES 0x0A    ///< The number of flash page writes (FLASH_WEAR_PAGES only).
+#define MNS_DIAGNOSTICS_WRITEAMP    0x0B    ///< Flash bytes programmed per byte changed (FLASH_WEAR_PAGES only).
+#define MNS_DIAGNOSTICS_WORSTPAGE   0x0C    ///< The page number of the most erased tracked flash page (FLASH_WEAR_PAGES only).
+#define MNS_DIAGNOSTICS_WORSTERASES 0x0D    ///< The lifetime erases of the most erased tracked flash page (FLASH_WEAR_PAGES only).
 
 /*
  * The module's node number.
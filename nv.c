@@ -58,6 +58,9 @@
 #include "nvm.h"
 #include "timedResponse.h"
 
+/** The number of NV defaults written at a time by nvFactoryReset().*/
+#define NV_RESET_CHUNK  16
+
 // forward declarations
 /**
  * Load the NV cache using values stored in non volatile memory.
@@ -122,11 +125,21 @@ extern uint8_t APP_nvDefault(uint8_t index);
 /**
  * The factoryReset for the NV service. Requests the application for defaults
  * for each NV and write those values to the non-volatile memory (NVM) store.
+ * The defaults are written in blocks so that NVs already holding their 
+ * default are not rewritten.
  */
 static void nvFactoryReset(void) {
+    uint8_t buffer[NV_RESET_CHUNK];
     uint8_t i;
+    uint8_t n;
+    
+    n = 0;
     for (i=1; i<= NV_NUM; i++) {
-        writeNVM(NV_NVM_TYPE, NV_ADDRESS+i, APP_nvDefault(i));
+        buffer[n++] = APP_nvDefault(i);
+        if ((n == NV_RESET_CHUNK) || (i == NV_NUM)) {
+            writeNVMBlock(NV_NVM_TYPE, NV_ADDRESS+i+1-n, buffer, n);
+            n = 0;
+        }
     }
 }
 
@@ -160,17 +173,7 @@ static DiagnosticVal * nvGetDiagnostic(uint8_t index) {
  * Load the NV cache using values stored in non volatile memory.
  */
 void loadNvCache(void) {
-    uint8_t i;
-    int16_t temp;
-    
-    for (i=1; i<= NV_NUM; i++) {
-        temp = readNVM(NV_NVM_TYPE, NV_ADDRESS+i);
-        if (temp < 0) {
-            // unsure how to handle an error here
-        } else {
-            nvCache[i] = (uint8_t)temp;
-        }
-    }
+    readNVMBlock(NV_NVM_TYPE, NV_ADDRESS+1, &nvCache[1], NV_NUM);
 }
 #endif
 
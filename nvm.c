@@ -56,6 +56,50 @@
  * If the buffer is dirty and bits have been cleared then the page first needs to 
  * be erased before the whole page is is written.
  * 
+ * FLASH_CACHE_PAGES may be defined in module.h to hold more than one page in RAM 
+ * buffers so that writes which alternate between pages, such as the event table 
+ * and its indexes, do not cause a page to be written each time. When a page not
+ * in a buffer is written the least recently written page is flushed to make room.
+ * Reads of a page held in a buffer are taken from the buffer.
+ * 
+ * EEPROM_WRITE_QUEUE may be defined in module.h to be the number of EEPROM 
+ * writes which can be queued. Writes are then started from the EEPROM write
+ * complete interrupt rather than the caller waiting about 4ms for each byte.
+ * Reads of an address with a queued write return the queued value. A write 
+ * which fails verification is retried up to EEPROM_WRITE_RETRIES times before
+ * being abandoned. flushEepromQueue() must be called before a RESET().
+ * 
+ * EEPROM_SHADOW_ADDRESS and EEPROM_SHADOW_SIZE may be defined in module.h to
+ * hold a copy of that range of EEPROM in RAM, loaded at power up. Reads of the
+ * range come from RAM. Writes of an unchanged value are skipped and changed 
+ * bytes are marked dirty and written to EEPROM one at a time by pollNVM().
+ * 
+ * readNVM(), writeNVM() and the block functions call the NvmBackend registered
+ * for the NVMtype. EEPROM and Flash backends are built in. RAM_NVM_SIZE may be
+ * defined in module.h to provide RAM_NVM_TYPE for tables which need not survive
+ * power off. The application may call registerNvmBackend() to provide 
+ * EXTERNAL_NVM_TYPE, for example SPI FRAM, or to replace a built in backend.
+ * 
+ * fillNVM() sets a range of NVM to one value. Whole Flash pages filled with 
+ * 0xFF are erased without being read into a buffer or programmed, and pages
+ * which are already erased are skipped. EEPROM bytes which already hold the
+ * value are not written.
+ * 
+ * Changed flash buffers are written out by pollNVM() once there have been no
+ * flash writes for FLASH_FLUSH_QUIET, so that a burst of writes such as a 
+ * teach sequence results in a single page write, or once a buffer has been 
+ * changed for FLASH_FLUSH_MAX_AGE whilst writes continue. Both may be set in 
+ * module.h. A buffer is also written when it is needed for another page, when 
+ * learn mode is left and when requested with requestFlashFlush() or 
+ * flushFlashBlock().
+ * 
+ * FLASH_WEAR_ADDRESS, FLASH_WEAR_PAGES and FLASH_WEAR_EEPROM_ADDRESS may be
+ * defined in module.h to count the erases of each of FLASH_WEAR_PAGES flash 
+ * pages from FLASH_WEAR_ADDRESS. The counts are for the life of the module 
+ * and are saved as 2 bytes per page in EEPROM from FLASH_WEAR_EEPROM_ADDRESS
+ * every FLASH_WEAR_SAVE_INTERVAL. The erases, page writes, write amplification
+ * and most erased page are reported as MNS diagnostics when VLCB_DIAG is defined.
+ * 
  */
 
 /**
@@ -73,24 +117,22 @@
  */
 
 #include <xc.h>
+#include <string.h> // for memcpy
 #include "vlcb.h"
 #include "hardware.h"
 #include "nvm.h"
 #include "mns.h"
+#ifdef NVM_HOST
+#include "nvm_host.h"
+#ifdef EEPROM_WRITE_QUEUE
+#error "EEPROM_WRITE_QUEUE is interrupt driven and cannot be used with NVM_HOST"
+#endif
+#endif
 
 #pragma optimize 1
 
-#if defined(_18F66K80_FAMILY_)
-#define FLASH_PAGE_SIZE _FLASH_ERASE_SIZE
-#endif
-
 #if defined(_18FXXQ83_FAMILY_)
 
-/**
- * Contains the size of a Flash page in bytes.
- */
-#define FLASH_PAGE_SIZE          (256U)
-
 /**
  * Contains the total size of Flash in bytes.
  */
@@ -128,24 +170,177 @@
 #define NVMCMD_NOP              0x07
 
 
+/*
+ * The number of flash pages held in the RAM write back cache. May be set in
+ * module.h to allow changes to several pages to be collected before any of 
+ * them are written. Each page uses FLASH_PAGE_SIZE bytes of RAM.
+ */
+#ifndef FLASH_CACHE_PAGES
+#define FLASH_CACHE_PAGES   1
+#endif
+
 // Structure for tracking Flash operations
-static union
+typedef union
 {
     uint8_t asByte;       
     struct  {
         uint8_t writeNeeded:1; //flag if buffer is modified
         uint8_t eraseNeeded:1;  //flag if long write with block erase
+        uint8_t loaded:1;       //flag if the buffer holds a flash block
     };
-} flashFlags;
+} FlashFlags;
+static FlashFlags flashFlags[FLASH_CACHE_PAGES];
+
+#if defined(_18F66K80_FAMILY_) || defined(NVM_HOST)
+static flash_data_t       flashBuffer[FLASH_CACHE_PAGES][FLASH_PAGE_SIZE];    // Assumes that Erase and Write are the same size
+/** The RAM buffer of a cached page.*/
+#define PAGE_BUFFER(p)      (flashBuffer[p])
+#endif
+#if defined(_18FXXQ83_FAMILY_) && !defined(NVM_HOST)
+// On the Q series the NVM peripheral uses a fixed RAM buffer at 0x3700
+flash_data_t        * nvmBuffer = (flash_data_t *)BUFFER_RAM_START_ADDRESS;
+#if FLASH_CACHE_PAGES > 1
+// Pages are copied through the NVM peripheral's buffer when read or written
+static flash_data_t       flashBuffer[FLASH_CACHE_PAGES][FLASH_PAGE_SIZE];
+/** The RAM buffer of a cached page.*/
+#define PAGE_BUFFER(p)      (flashBuffer[p])
+#else
+/** The RAM buffer of a cached page.*/
+#define PAGE_BUFFER(p)      (nvmBuffer)
+#endif
+#endif
+static flash_address_t    flashBlock[FLASH_CACHE_PAGES];     //address of each cached flash block
+/**
+ * The cached pages ordered from most to least recently written.
+ */
+static uint8_t flashOrder[FLASH_CACHE_PAGES];
+/** Indicates that a flash block is not in the cache.*/
+#define NO_PAGE     0xFF
+
+/**
+ * The steps of a flush requested by requestFlashFlush() and performed by pollNVM().
+ */
+static enum {
+    FLUSH_IDLE,         ///< no flush requested
+    FLUSH_PENDING       ///< write each changed page, one erase and write per poll
+} flushState;
+static FlashFlushCallback flushCallback;    ///< called when the requested flush is complete
+
+/*
+ * The time since the last flash write after which changed buffers are written
+ * out. May be set in module.h.
+ */
+#ifndef FLASH_FLUSH_QUIET
+#define FLASH_FLUSH_QUIET       (2*ONE_SECOND)
+#endif
+/*
+ * The longest time a buffer may remain changed whilst writes continue. May be
+ * set in module.h.
+ */
+#ifndef FLASH_FLUSH_MAX_AGE
+#define FLASH_FLUSH_MAX_AGE     (30*ONE_SECOND)
+#endif
+static uint8_t flashDirty;          ///< a flash buffer has been changed since the last flush
+static TickValue flashDirtyTime;    ///< when a buffer was first changed since the last flush
+static TickValue flashWriteTime;    ///< when a buffer was last changed
 
 #if defined(_18F66K80_FAMILY_)
-static flash_data_t       flashBuffer[FLASH_PAGE_SIZE];    // Assumes that Erase and Write are the same size
+#define EE_IF       EEIF                ///< EEPROM write complete interrupt flag
+#define EE_IE       PIE4bits.EEIE       ///< EEPROM write complete interrupt enable
+#define EE_BUSY     EECON1bits.WR       ///< An EEPROM write is in progress
 #endif
 #if defined(_18FXXQ83_FAMILY_)
-// On the Q series the NVM peripheral uses a fixed RAM buffer at 0x3700
- flash_data_t        * flashBuffer = (flash_data_t *)BUFFER_RAM_START_ADDRESS;
+#define EE_IF       NVMIF               ///< NVM operation complete interrupt flag
+#define EE_IE       NVMIE               ///< NVM operation complete interrupt enable
+#define EE_BUSY     NVMCON0bits.GO      ///< An NVM operation is in progress
+#endif
+
+#ifdef EEPROM_WRITE_QUEUE
+/*
+ * The number of attempts made at writing each queued EEPROM byte. May be set 
+ * in module.h.
+ */
+#ifndef EEPROM_WRITE_RETRIES
+#define EEPROM_WRITE_RETRIES    3
+#endif
+
+/**
+ * A byte waiting to be written to EEPROM.
+ */
+typedef struct {
+    eeprom_address_t address;
+    eeprom_data_t value;
+} EepromWrite;
+static EepromWrite eepromQueue[EEPROM_WRITE_QUEUE];
+static uint8_t eepromHead;      ///< the oldest queued write
+static uint8_t eepromCount;     ///< the number of queued writes
+static uint8_t eepromWriting;   ///< the oldest queued write has been started
+static uint8_t eepromRetries;   ///< failed attempts at the oldest queued write
+/** Provides the queue entry of the i'th oldest queued write.*/
+#define QUEUE_SLOT(i)   ((eepromHead+(i))%EEPROM_WRITE_QUEUE)
+
+/** Stop the queue from being serviced and wait for any write in progress to complete.*/
+#define PAUSE_EEPROM_QUEUE()    {EE_IE = 0; while (EE_BUSY);}
+/** Allow the queue to be serviced again.*/
+#define RESUME_EEPROM_QUEUE()   {EE_IE = 1;}
+
+static void serviceEepromQueue(void);
+#elif defined(EEPROM_SHADOW_SIZE)
+#define PAUSE_EEPROM_QUEUE()    {while (EE_BUSY);}
+#define RESUME_EEPROM_QUEUE()
+#else
+#define PAUSE_EEPROM_QUEUE()
+#define RESUME_EEPROM_QUEUE()
+#endif
+
+#ifdef EEPROM_SHADOW_SIZE
+static eeprom_data_t eepromShadow[EEPROM_SHADOW_SIZE];     ///< RAM copy of the shadowed EEPROM
+static uint8_t eepromDirty[(EEPROM_SHADOW_SIZE+7)/8];       ///< bytes not yet written to EEPROM
+static uint16_t shadowNext;     ///< where to continue looking for dirty bytes
+#ifndef EEPROM_WRITE_QUEUE
+static uint16_t shadowWriting;  ///< the byte being written or NO_SHADOW
+#endif
+/** Indicates that no shadowed byte is being written.*/
+#define NO_SHADOW           0xFFFF
+/** Provides whether an EEPROM address is within the shadowed range.*/
+#define IN_SHADOW(A)        (((A) >= EEPROM_SHADOW_ADDRESS) && ((A) < EEPROM_SHADOW_ADDRESS+EEPROM_SHADOW_SIZE))
+/** Provides whether a shadowed byte is dirty given its offset.*/
+#define SHADOW_DIRTY(o)     (eepromDirty[(o)>>3] & (1<<((o)&7)))
+
+static void pollEepromShadow(void);
+#endif
+
+#ifdef FLASH_WEAR_PAGES
+/*
+ * How often changed erase counts are saved to EEPROM. May be set in module.h.
+ */
+#ifndef FLASH_WEAR_SAVE_INTERVAL
+#define FLASH_WEAR_SAVE_INTERVAL    (10*ONE_MINUTE)
+#endif
+static uint16_t pageErases[FLASH_WEAR_PAGES];      ///< lifetime erases of each tracked page
+static uint8_t pageErasesChanged[(FLASH_WEAR_PAGES+7)/8];  ///< counts not yet saved
+static uint8_t wearChanged;         ///< the diagnostics need updating
+static TickValue wearSaveTime;      ///< when the counts were last saved
+static uint32_t flashBytesChanged;  ///< bytes changed by FLASH_Write since power up
+static uint32_t flashBytesWritten;  ///< bytes programmed since power up
+/** Provides the tracked page index of a flash address, FLASH_WEAR_PAGES if not tracked.*/
+#define WEAR_PAGE(A)    ((((A) >= FLASH_WEAR_ADDRESS) && ((A) < FLASH_WEAR_ADDRESS + (uint24_t)FLASH_WEAR_PAGES*FLASH_PAGE_SIZE)) ? \
+                            (uint16_t)(((A) - FLASH_WEAR_ADDRESS)/FLASH_PAGE_SIZE) : FLASH_WEAR_PAGES)
+
+static void loadFlashWear(void);
+static void pollFlashWear(void);
 #endif
-static flash_address_t    flashBlock;     //address of current flash block
+
+static uint8_t writeEeprom(eeprom_address_t index, eeprom_data_t value);
+static void writeEepromAndWait(eeprom_address_t index, eeprom_data_t value);
+static eeprom_data_t readEeprom(eeprom_address_t index);
+static void startEepromWrite(eeprom_address_t index, eeprom_data_t value);
+static uint8_t findFlashPage(flash_address_t block);
+static void eraseFlashBlock(uint8_t page);
+static void writeFlashBlock(uint8_t page);
+static void programFlashBlock(uint8_t page);
+static void loadFlashBlock(uint8_t page);
+uint8_t FLASH_Write(flash_address_t index, flash_data_t value);
 
 /** Provides the Flash Block number given an address.*/
 #define BLOCK(A)    (A&(~((flash_address_t)FLASH_PAGE_SIZE-1)))
@@ -156,13 +351,49 @@ static flash_address_t    flashBlock;     //address of current flash block
  *  Initialise variables for Flash program tracking.
  */
 void initRomOps(void) {
-    flashFlags.asByte = 0;  // no write and no erase
-    flashBlock = 0x0800; // invalid but as long a write isn't needed it will be 
-                         // ok. Next write will always be to a different block.
+    uint8_t p;
+    for (p=0; p<FLASH_CACHE_PAGES; p++) {
+        flashFlags[p].asByte = 0;  // not loaded, no write and no erase
+        flashOrder[p] = p;
+    }
+    flushState = FLUSH_IDLE;
+    flushCallback = NULL;
+    flashDirty = 0;
+#ifdef NVM_HOST
+    hostNvmOpen();
+#else
     TBLPTRU = 0;
 #if defined(_18FXXQ83_FAMILY_)
     NVMCON1bits.WRERR = 0;
 #endif
+#endif
+#ifdef EEPROM_WRITE_QUEUE
+    eepromHead = 0;
+    eepromCount = 0;
+    eepromWriting = 0;
+    eepromRetries = 0;
+    EE_IF = 0;
+#if defined(_18F66K80_FAMILY_)
+    IPR4bits.EEIP = 0;      // serviced by the low priority ISR
+#endif
+    EE_IE = 1;
+#endif
+#ifdef EEPROM_SHADOW_SIZE
+    for (shadowNext=0; shadowNext<EEPROM_SHADOW_SIZE; shadowNext++) {
+        eepromShadow[shadowNext] = readEeprom(EEPROM_SHADOW_ADDRESS + shadowNext);
+    }
+    for (shadowNext=0; shadowNext<sizeof(eepromDirty); shadowNext++) {
+        eepromDirty[shadowNext] = 0;
+    }
+    shadowNext = 0;
+#ifndef EEPROM_WRITE_QUEUE
+    shadowWriting = NO_SHADOW;
+#endif
+#endif
+#ifdef FLASH_WEAR_PAGES
+    // read through EEPROM_Read() so the shadow must already be loaded
+    loadFlashWear();
+#endif
 }
 
 /**
@@ -171,6 +402,46 @@ void initRomOps(void) {
  * @return the value
  */
 eeprom_data_t EEPROM_Read(eeprom_address_t index) {
+#ifdef EEPROM_WRITE_QUEUE
+    uint8_t i;
+    uint8_t queueEnabled;
+    eeprom_data_t value;
+#endif
+    
+#ifdef EEPROM_SHADOW_SIZE
+    if (IN_SHADOW(index)) {
+        return eepromShadow[index - EEPROM_SHADOW_ADDRESS];
+    }
+#endif
+#ifdef EEPROM_WRITE_QUEUE
+    // restore rather than set the enable so that a paused queue stays paused
+    queueEnabled = EE_IE;
+    EE_IE = 0;
+    // A queued write is the newest value for its address
+    for (i=eepromCount; i>0; i--) {
+        if (eepromQueue[QUEUE_SLOT(i-1)].address == index) {
+            value = eepromQueue[QUEUE_SLOT(i-1)].value;
+            EE_IE = queueEnabled;
+            return value;
+        }
+    }
+    value = readEeprom(index);
+    EE_IE = queueEnabled;
+    return value;
+#else
+    return readEeprom(index);
+#endif
+}
+
+/**
+ * Read a byte directly from EEPROM.  
+ * @param index the address
+ * @return the value
+ */
+static eeprom_data_t readEeprom(eeprom_address_t index) {
+#ifdef NVM_HOST
+    return hostEepromRead(index);
+#else
 #if defined (_18F66K80_FAMILY_)
     // do read of EEPROM
     while (EECON1bits.WR)       // Errata says this is required
@@ -209,6 +480,7 @@ eeprom_data_t EEPROM_Read(eeprom_address_t index) {
     NVMCON1bits.NVMCMD = NVMCMD_NOP;
     return NVMDATL;
 #endif
+#endif
 }
 
 /**
@@ -218,14 +490,90 @@ eeprom_data_t EEPROM_Read(eeprom_address_t index) {
  * @return 0 for success or error otherwise
  */
 uint8_t EEPROM_Write(eeprom_address_t index, eeprom_data_t value) {
-    uint8_t interruptEnabled;
-    interruptEnabled = geti(); // store current global interrupt state
+#ifdef EEPROM_SHADOW_SIZE
+    uint16_t o;
+    
+    if (IN_SHADOW(index)) {
+        o = index - EEPROM_SHADOW_ADDRESS;
+        if (eepromShadow[o] != value) {
+            // written out later by pollNVM()
+            eepromShadow[o] = value;
+            eepromDirty[o>>3] |= (1<<(o&7));
+        }
+        return GRSP_OK;
+    }
+#endif
+    return writeEeprom(index, value);
+}
+
+/**
+ * Set a range of EEPROM to a value. Bytes already holding the value are not
+ * written.
+ * @param index the address of the first byte
+ * @param value the value to be written
+ * @param length the number of bytes
+ * @return 0 for success or error otherwise
+ */
+static uint8_t EEPROM_Fill(eeprom_address_t index, eeprom_data_t value, uint24_t length) {
+    uint8_t error;
+    for (; length > 0; length--, index++) {
+        if (EEPROM_Read(index) != value) {
+            error = EEPROM_Write(index, value);
+            if (error != GRSP_OK) {
+                return error;
+            }
+        }
+    }
+    return GRSP_OK;
+}
 
+/**
+ * Write a byte to EEPROM, queuing it if EEPROM_WRITE_QUEUE is defined.
+ * @param index the address
+ * @param value the value to be written
+ * @return 0 for success or error otherwise
+ */
+static uint8_t writeEeprom(eeprom_address_t index, eeprom_data_t value) {
+#ifdef EEPROM_WRITE_QUEUE
+    uint8_t i;
+    uint8_t queueEnabled;
+    
+    queueEnabled = EE_IE;
+    EE_IE = 0;
+    // Update a queued write to the same address if it has not yet been started
+    for (i=eepromCount; i>(eepromWriting?1:0); i--) {
+        if (eepromQueue[QUEUE_SLOT(i-1)].address == index) {
+            eepromQueue[QUEUE_SLOT(i-1)].value = value;
+            EE_IE = queueEnabled;
+            return GRSP_OK;
+        }
+    }
+    while (eepromCount == EEPROM_WRITE_QUEUE) {
+        // queue is full so wait for the oldest write to complete
+        while (EE_BUSY)
+            ;
+        serviceEepromQueue();
+    }
+    eepromQueue[QUEUE_SLOT(eepromCount)].address = index;
+    eepromQueue[QUEUE_SLOT(eepromCount)].value = value;
+    eepromCount++;
+#ifdef VLCB_DIAG
+    if (eepromCount > mnsDiagnostics[MNS_DIAGNOSTICS_EEQUEUE].asUint) {
+        mnsDiagnostics[MNS_DIAGNOSTICS_EEQUEUE].asUint = eepromCount;
+    }
+#endif
+    if (! eepromWriting) {
+        startEepromWrite(index, value);
+        eepromWriting = 1;
+    }
+    EE_IE = queueEnabled;
+    return GRSP_OK;
+#else
     do {
-        EEPROM_WriteNoVerify(index, value);
+        writeEepromAndWait(index, value);
 
         // check that it worked
-        if (EEPROM_Read(index) == value) {
+        if (readEeprom(index) == value) {
             break;
         }
 #ifdef VLCB_DIAG
@@ -233,12 +581,164 @@ uint8_t EEPROM_Write(eeprom_address_t index, eeprom_data_t value) {
         updateModuleErrorStatus();
 #endif
     } while (1);
-#if defined(_18FXXQ83_FAMILY_)
+#if defined(_18FXXQ83_FAMILY_) && !defined(NVM_HOST)
     //Clear the NVM Command
     NVMCON1bits.NVMCMD = NVMCMD_NOP;
     NVMADR = 0;
 #endif
     return GRSP_OK;
+#endif
+}
+
+#ifdef EEPROM_WRITE_QUEUE
+/**
+ * Complete the oldest queued EEPROM write and start the next. Called from the
+ * ISR, or with the interrupt disabled, once the write in progress has finished.
+ * The write is checked and retried if it failed.
+ */
+static void serviceEepromQueue(void) {
+    EE_IF = 0;
+    if (eepromWriting) {
+        eepromWriting = 0;
+        if (readEeprom(eepromQueue[eepromHead].address) != eepromQueue[eepromHead].value) {
+#ifdef VLCB_DIAG
+            mnsDiagnostics[MNS_DIAGNOSTICS_MEMERRS].asUint++;
+            updateModuleErrorStatus();
+#endif
+            eepromRetries++;
+            if (eepromRetries < EEPROM_WRITE_RETRIES) {
+                startEepromWrite(eepromQueue[eepromHead].address, eepromQueue[eepromHead].value);
+                eepromWriting = 1;
+                return;
+            }
+            // give up on this write
+#ifdef VLCB_DIAG
+            mnsDiagnostics[MNS_DIAGNOSTICS_EEFAILS].asUint++;
+#endif
+        }
+        eepromHead = QUEUE_SLOT(1);
+        eepromCount--;
+        eepromRetries = 0;
+    }
+    if (eepromCount > 0) {
+        startEepromWrite(eepromQueue[eepromHead].address, eepromQueue[eepromHead].value);
+        eepromWriting = 1;
+    } else {
+#if defined(_18FXXQ83_FAMILY_)
+        //Clear the NVM Command
+        NVMCON1bits.NVMCMD = NVMCMD_NOP;
+        NVMADR = 0;
+#endif
+    }
+}
+
+#if defined(_18F66K80_FAMILY_)
+/**
+ * The low priority interrupt handler for the EEPROM write queue. Called by VLCB's
+ * low priority ISR.
+ */
+void nvmLowIsr(void) {
+    if (EE_IE && EE_IF) {
+        serviceEepromQueue();
+    }
+}
+#endif
+#if defined(_18FXXQ83_FAMILY_)
+/**
+ * The NVM interrupt service routine. Services the EEPROM write queue.
+ */
+void __interrupt(irq(NVM), base(IVT_BASE)) NVM_ISR(void)
+{
+    serviceEepromQueue();
+}
+#endif
+#endif
+
+#ifdef EEPROM_SHADOW_SIZE
+/**
+ * Write the next dirty shadowed byte to EEPROM. Without EEPROM_WRITE_QUEUE 
+ * the write is started and checked on a later call so that this does not 
+ * wait for the write to complete.
+ */
+static void pollEepromShadow(void) {
+    uint16_t i;
+    
+#ifndef EEPROM_WRITE_QUEUE
+#ifndef NVM_HOST
+    if (EE_BUSY) return;
+#endif
+    if (shadowWriting != NO_SHADOW) {
+        if (readEeprom(EEPROM_SHADOW_ADDRESS + shadowWriting) != eepromShadow[shadowWriting]) {
+            // failed or changed whilst being written so write it again
+            eepromDirty[shadowWriting>>3] |= (1<<(shadowWriting&7));
+        }
+        shadowWriting = NO_SHADOW;
+#if defined(_18FXXQ83_FAMILY_) && !defined(NVM_HOST)
+        //Clear the NVM Command
+        NVMCON1bits.NVMCMD = NVMCMD_NOP;
+        NVMADR = 0;
+#endif
+    }
+#endif
+    for (i=0; i<EEPROM_SHADOW_SIZE; i++) {
+        if (SHADOW_DIRTY(shadowNext)) {
+            eepromDirty[shadowNext>>3] &= ~(1<<(shadowNext&7));
+#ifdef EEPROM_WRITE_QUEUE
+            writeEeprom(EEPROM_SHADOW_ADDRESS + shadowNext, eepromShadow[shadowNext]);
+#else
+            startEepromWrite(EEPROM_SHADOW_ADDRESS + shadowNext, eepromShadow[shadowNext]);
+            shadowWriting = shadowNext;
+#endif
+            return;
+        }
+        shadowNext++;
+        if (shadowNext >= EEPROM_SHADOW_SIZE) {
+            shadowNext = 0;
+        }
+    }
+}
+#endif
+
+/**
+ * Wait until all queued and shadowed EEPROM writes have been completed.
+ */
+void flushEepromQueue(void) {
+#ifdef EEPROM_WRITE_QUEUE
+    uint8_t queueEnabled;
+#endif
+#ifdef EEPROM_SHADOW_SIZE
+    uint16_t o;
+    
+#ifndef EEPROM_WRITE_QUEUE
+#ifndef NVM_HOST
+    while (EE_BUSY)
+        ;
+#endif
+    if (shadowWriting != NO_SHADOW) {
+        // check the write started by pollEepromShadow()
+        if (readEeprom(EEPROM_SHADOW_ADDRESS + shadowWriting) != eepromShadow[shadowWriting]) {
+            eepromDirty[shadowWriting>>3] |= (1<<(shadowWriting&7));
+        }
+        shadowWriting = NO_SHADOW;
+    }
+#endif
+    for (o=0; o<EEPROM_SHADOW_SIZE; o++) {
+        if (SHADOW_DIRTY(o)) {
+            eepromDirty[o>>3] &= ~(1<<(o&7));
+            writeEeprom(EEPROM_SHADOW_ADDRESS + o, eepromShadow[o]);
+        }
+    }
+#endif
+#ifdef EEPROM_WRITE_QUEUE
+    queueEnabled = EE_IE;
+    EE_IE = 0;
+    while (eepromCount > 0) {
+        while (EE_BUSY)
+            ;
+        serviceEepromQueue();
+    }
+    EE_IE = queueEnabled;
+#endif
 }
 
 /**
@@ -248,9 +748,66 @@ uint8_t EEPROM_Write(eeprom_address_t index, eeprom_data_t value) {
  * @return 0 for success or error otherwise
  */
 uint8_t EEPROM_WriteNoVerify(eeprom_address_t index, eeprom_data_t value) {
-    uint8_t interruptEnabled;
-    interruptEnabled = geti(); // store current global interrupt state
+#ifdef EEPROM_WRITE_QUEUE
+    uint8_t queueEnabled;
+#endif
+#if defined(EEPROM_WRITE_QUEUE) || defined(EEPROM_SHADOW_SIZE)
+    flushEepromQueue();
+#endif
+#ifdef EEPROM_SHADOW_SIZE
+    if (IN_SHADOW(index)) {
+        eepromShadow[index - EEPROM_SHADOW_ADDRESS] = value;
+    }
+#endif
+#ifdef EEPROM_WRITE_QUEUE
+    queueEnabled = EE_IE;
+    EE_IE = 0;
+#endif
+    writeEepromAndWait(index, value);
+#ifdef EEPROM_WRITE_QUEUE
+    EE_IE = queueEnabled;
+#endif
+    return GRSP_OK;
+}
+
+/**
+ * Write a byte to EEPROM waiting for the write to complete on the K80.
+ * @param index the address
+ * @param value the value to be written
+ */
+static void writeEepromAndWait(eeprom_address_t index, eeprom_data_t value) {
+#ifdef NVM_HOST
+    hostEepromWrite(index, value);
+#else
+    startEepromWrite(index, value);
 #if defined (_18F66K80_FAMILY_)
+    while (EECON1bits.WR)       // should wait until WR clears
+        ;
+    while (!EEIF)
+        ;
+    EEIF = 0;
+#endif
+#endif
+}
+
+/**
+ * Start writing a byte to EEPROM without waiting for it to complete.
+ * @param index the address
+ * @param value the value to be written
+ */
+static void startEepromWrite(eeprom_address_t index, eeprom_data_t value) {
+#ifdef NVM_HOST
+    hostEepromWrite(index, value);
+#else
+#if defined (_18F66K80_FAMILY_)
+    uint8_t highEnabled;
+    uint8_t lowEnabled;
+    // May be called from the low priority ISR, where GIEL is clear and must
+    // stay clear, so the two enables are saved and restored separately
+    highEnabled = INTCONbits.GIEH;
+    lowEnabled = INTCONbits.GIEL;
+    while (EECON1bits.WR)       // a previous write may still be in progress
+        ;
     SET_EADDRH((index >> 8)&0xFF);      // High byte of address to write
     EEADR = index & 0xFF;       	/* Low byte of Data Memory Address to write */
     EEDATA = value;
@@ -262,18 +819,13 @@ uint8_t EEPROM_WriteNoVerify(eeprom_address_t index, eeprom_data_t value) {
     EECON2 = 0x55;
     EECON2 = 0xAA;
     EECON1bits.WR = 1;
-    while (EECON1bits.WR)       // should wait until WR clears
-        ;
-    while (!EEIF)
-        ;
-    EEIF = 0;
-    if (interruptEnabled) {     // Only enable interrupts if they were enabled at function entry
-        /* Re-enable Interrupts */
-        bothEi();                  
-    }
-    EECON1bits.WREN = 0;		/* Disable writes */
+    INTCONbits.GIEL = lowEnabled;
+    INTCONbits.GIEH = highEnabled;
+    EECON1bits.WREN = 0;		/* Disable writes, the write in progress continues */
 #endif
 #if defined(_18FXXQ83_FAMILY_)
+    uint8_t interruptEnabled;
+    interruptEnabled = geti(); // store current global interrupt state
     // ready?
     while (NVMCON0bits.GO)
         ;
@@ -304,7 +856,7 @@ uint8_t EEPROM_WriteNoVerify(eeprom_address_t index, eeprom_data_t value) {
     }
 
 #endif
-    return GRSP_OK;
+#endif
 }
 
 
@@ -315,12 +867,17 @@ uint8_t EEPROM_WriteNoVerify(eeprom_address_t index, eeprom_data_t value) {
  * @return the value
  */
 static flash_data_t FLASH_Read(flash_address_t address) {
+    uint8_t p;
     // do read of Flash
-    if (BLOCK(address) == flashBlock) {
-        // if the block is the current one then get it directly
-        return flashBuffer[OFFSET(address)];
+    p = findFlashPage(BLOCK(address));
+    if (p != NO_PAGE) {
+        // if the block is cached then get it directly
+        return PAGE_BUFFER(p)[OFFSET(address)];
     } else {
         // we'll read single byte from flash
+#ifdef NVM_HOST
+        return hostFlashRead(address);
+#else
 #if defined (_18F66K80_FAMILY_)
         TBLPTR = address;
         TBLPTRU = 0;
@@ -335,24 +892,110 @@ static flash_data_t FLASH_Read(flash_address_t address) {
         asm("TBLRD*");
 #endif
         return TABLAT;
+#endif
     }
 }
 
+/**
+ * Read a sequence of bytes from Flash. The table pointer is set up once for 
+ * each block and then auto incremented.
+ * @param address the address of the first byte
+ * @param buffer where the bytes are to be put
+ * @param length the number of bytes
+ */
+static void FLASH_ReadBlock(flash_address_t address, uint8_t * buffer, uint8_t length) {
+    uint8_t p;
+    uint8_t i;
+    uint16_t n;
+    
+    while (length > 0) {
+        // read up to the end of the block
+        n = FLASH_PAGE_SIZE - OFFSET(address);
+        if (n > length) {
+            n = length;
+        }
+        p = findFlashPage(BLOCK(address));
+        if (p != NO_PAGE) {
+            // if the block is cached then get it directly
+            memcpy(buffer, PAGE_BUFFER(p) + OFFSET(address), n);
+        } else {
+#ifdef NVM_HOST
+            for (i=0; i<n; i++) {
+                buffer[i] = hostFlashRead(address + i);
+            }
+#else
+#if defined (_18F66K80_FAMILY_)
+            TBLPTR = address;
+            TBLPTRU = 0;
+#endif
+#if defined (_18FXXQ83_FAMILY_)
+            TBLPTRU = (uint8_t) (address >> 16);
+            TBLPTRH = (uint8_t) (address >> 8);
+            TBLPTRL = (uint8_t) address;
+#endif
+            for (i=0; i<n; i++) {
+                asm("TBLRD*+");
+                NOP();
+                buffer[i] = TABLAT;
+            }
+#endif
+        }
+        address += n;
+        buffer += n;
+        length -= (uint8_t)n;
+    }
+}
+
+/**
+ * Find a flash block in the cache.
+ * @param block the address of the start of the block
+ * @return the cached page or NO_PAGE
+ */
+static uint8_t findFlashPage(flash_address_t block) {
+    uint8_t p;
+    for (p=0; p<FLASH_CACHE_PAGES; p++) {
+        if (flashFlags[p].loaded && (flashBlock[p] == block)) {
+            return p;
+        }
+    }
+    return NO_PAGE;
+}
+
 /**
  * Erase a block of flash.
  * May block awaiting for the application to indicate that it is a suitable time
  * to allow the CPU to be halted.
+ * @param page the cached page whose block is to be erased
  */
-void eraseFlashBlock(void) {
+static void eraseFlashBlock(uint8_t page) {
+#ifdef FLASH_WEAR_PAGES
+    uint16_t w;
+    
+    w = WEAR_PAGE(flashBlock[page]);
+    if (w < FLASH_WEAR_PAGES) {
+        if (pageErases[w] < 0xFFFF) {
+            pageErases[w]++;
+        }
+        pageErasesChanged[w>>3] |= (1<<(w&7));
+    }
+#ifdef VLCB_DIAG
+    mnsDiagnostics[MNS_DIAGNOSTICS_FLASHERASES].asUint++;
+#endif
+    wearChanged = 1;
+#endif
+#ifdef NVM_HOST
+    hostFlashErase(flashBlock[page]);
+#else
     uint8_t interruptEnabled;
     // Call back into the application to check if now is a good time to write the flash
     // as the processor will be suspended for up to 2ms.
     while (! APP_isSuitableTimeToWriteFlash())
         ;
     
+    PAUSE_EEPROM_QUEUE();
     interruptEnabled = geti(); // store current global interrupt state
 #if defined (_18F66K80_FAMILY_)
-    TBLPTR = flashBlock;
+    TBLPTR = flashBlock[page];
     TBLPTRU = 0;
     EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
     EECON1bits.CFGS = 0;    // 0=Program memory/EEPROM, 1=ConfigBits
@@ -371,8 +1014,8 @@ void eraseFlashBlock(void) {
     while (NVMCON0bits.GO)
         ;
     //Load NVMADR with the any address in the memory page. NVMADRL is ignored
-    NVMADRU = (uint8_t) (flashBlock >> 16);
-    NVMADRH = (uint8_t) (flashBlock >> 8);
+    NVMADRU = (uint8_t) (flashBlock[page] >> 16);
+    NVMADRH = (uint8_t) (flashBlock[page] >> 8);
 
     NVMCON1bits.NVMCMD = NVMCMD_ERASEPAGE;      //Set the page erase command
     bothDi();                       // disable all interrupts
@@ -387,37 +1030,231 @@ void eraseFlashBlock(void) {
     if (interruptEnabled) {     // Only enable interrupts if they were enabled at function entry
         bothEi();                   /* Enable Interrupts */
     }
+    RESUME_EEPROM_QUEUE();
+#endif
 }
 
 
 /**
- * Flush the current flash buffer out to flash.
+ * Erase a range of flash. Whole pages are erased directly, unless already 
+ * erased, and left in a buffer as clean so that later writes to the page 
+ * need no erase. Bytes in partial pages at either end are written with 0xFF.
+ * May block awaiting for the application to indicate that it is a suitable time
+ * to allow the CPU to be halted.
+ * @param address the address of the first byte
+ * @param length the number of bytes
+ */
+static void FLASH_Erase(flash_address_t address, uint24_t length) {
+    uint8_t p;
+    uint16_t i;
+    uint8_t blank;
+    
+    while (length > 0) {
+        if ((OFFSET(address) != 0) || (length < FLASH_PAGE_SIZE)) {
+            FLASH_Write(address++, 0xFF);
+            length--;
+            continue;
+        }
+        p = findFlashPage(address);
+        if (p == NO_PAGE) {
+            // use the least recently written buffer
+            p = flashOrder[FLASH_CACHE_PAGES-1];
+            writeFlashBlock(p);
+        }
+        // discard the buffer so that the flash itself is checked
+        flashFlags[p].asByte = 0;
+        blank = 1;
+        for (i=0; i<FLASH_PAGE_SIZE; i++) {
+            if (FLASH_Read(address+i) != 0xFF) {
+                blank = 0;
+                break;
+            }
+        }
+        flashBlock[p] = address;
+        memset(PAGE_BUFFER(p), 0xFF, FLASH_PAGE_SIZE);
+        flashFlags[p].loaded = 1;
+        if (! blank) {
+            eraseFlashBlock(p);
+        }
+        address += FLASH_PAGE_SIZE;
+        length -= FLASH_PAGE_SIZE;
+    }
+}
+
+/**
+ * Flush all of the changed flash buffers out to flash.
  * Will suspend the CPU.
  */
 void flushFlashBlock(void) {
-    uint8_t interruptEnabled;
-#if defined (_18F66K80_FAMILY_)
-    TBLPTR = flashBlock; //force row boundary
-    TBLPTRU = 0;
+    uint8_t p;
+    for (p=0; p<FLASH_CACHE_PAGES; p++) {
+        writeFlashBlock(p);
+    }
+}
+
+/**
+ * Request that all of the changed flash buffers are written out to flash by
+ * pollNVM() without blocking. Writes made before the flush is complete are
+ * included. Any callback of an earlier request which has not yet completed 
+ * is replaced, unless the new callback is NULL.
+ * @param callback function called when the flush is complete, may be NULL
+ */
+void requestFlashFlush(FlashFlushCallback callback) {
+    flushState = FLUSH_PENDING;
+    if (callback != NULL) {
+        flushCallback = callback;
+    }
+}
+
+/**
+ * Perform the next step of a flush requested by requestFlashFlush(), or started
+ * because the flash buffers have been quiet for FLASH_FLUSH_QUIET or changed 
+ * for FLASH_FLUSH_MAX_AGE. Should be called regularly, nothing is done unless 
+ * the application indicates that it is a suitable time to suspend the CPU. 
+ * Each call erases and writes at most one page. Also writes out
+ * dirty shadowed EEPROM bytes.
+ */
+void pollNVM(void) {
+    uint8_t p;
+    FlashFlushCallback callback;
+    
+#ifdef EEPROM_SHADOW_SIZE
+    pollEepromShadow();
 #endif
-#if defined (_18FXXQ83_FAMILY_)
+#ifdef FLASH_WEAR_PAGES
+    pollFlashWear();
+#endif
+    if (flushState == FLUSH_IDLE) {
+        if (! flashDirty) return;
+        if ((tickTimeSince(flashWriteTime) < FLASH_FLUSH_QUIET) &&
+                (tickTimeSince(flashDirtyTime) < FLASH_FLUSH_MAX_AGE)) return;
+        flushState = FLUSH_PENDING;
+    }
+    for (p=0; p<FLASH_CACHE_PAGES; p++) {
+        if (flashFlags[p].writeNeeded) break;
+    }
+    if (p == FLASH_CACHE_PAGES) {
+        // nothing left to write
+        flushState = FLUSH_IDLE;
+        flashDirty = 0;
+        callback = flushCallback;
+        flushCallback = NULL;
+        if (callback != NULL) {
+            callback();
+        }
+        return;
+    }
+    if (APP_isSuitableTimeToWriteFlash() == BAD_TIME) return;   // try again later
+    // Only the start of the erase is deferred. The block is programmed straight
+    // after it is erased so that it is never left blank.
+    writeFlashBlock(p);
+}
+
+#ifdef FLASH_WEAR_PAGES
+/**
+ * Load the erase counts saved in EEPROM. Erased EEPROM is a count of zero.
+ */
+static void loadFlashWear(void) {
+    uint16_t w;
+    
+    for (w=0; w<FLASH_WEAR_PAGES; w++) {
+        pageErases[w] = (uint16_t)EEPROM_Read(FLASH_WEAR_EEPROM_ADDRESS + 2*w) |
+                ((uint16_t)EEPROM_Read(FLASH_WEAR_EEPROM_ADDRESS + 2*w + 1) << 8);
+        if (pageErases[w] == 0xFFFF) {
+            pageErases[w] = 0;
+        }
+    }
+    memset(pageErasesChanged, 0, sizeof(pageErasesChanged));
+    flashBytesChanged = 0;
+    flashBytesWritten = 0;
+    wearChanged = 1;
+    wearSaveTime.val = 0;
+}
+
+/**
+ * Update the wear diagnostics and periodically save changed erase counts to EEPROM.
+ */
+static void pollFlashWear(void) {
+    uint16_t w;
+    uint16_t most;
     
+    if (wearChanged) {
+        wearChanged = 0;
+#ifdef VLCB_DIAG
+        most = 0;
+        for (w=1; w<FLASH_WEAR_PAGES; w++) {
+            if (pageErases[w] > pageErases[most]) {
+                most = w;
+            }
+        }
+        mnsDiagnostics[MNS_DIAGNOSTICS_WORSTPAGE].asUint = (uint16_t)((FLASH_WEAR_ADDRESS + (uint24_t)most*FLASH_PAGE_SIZE)/FLASH_PAGE_SIZE);
+        mnsDiagnostics[MNS_DIAGNOSTICS_WORSTERASES].asUint = pageErases[most];
+        if (flashBytesChanged > 0) {
+            mnsDiagnostics[MNS_DIAGNOSTICS_WRITEAMP].asUint = (uint16_t)(flashBytesWritten / flashBytesChanged);
+        }
+#endif
+    }
+    if (tickTimeSince(wearSaveTime) < FLASH_WEAR_SAVE_INTERVAL) return;
+    wearSaveTime.val = tickGet();
+    for (w=0; w<FLASH_WEAR_PAGES; w++) {
+        if (pageErasesChanged[w>>3] & (1<<(w&7))) {
+            pageErasesChanged[w>>3] &= ~(1<<(w&7));
+            EEPROM_Write(FLASH_WEAR_EEPROM_ADDRESS + 2*w, pageErases[w] & 0xFF);
+            EEPROM_Write(FLASH_WEAR_EEPROM_ADDRESS + 2*w + 1, pageErases[w] >> 8);
+        }
+    }
+}
 #endif
-    if (! flashFlags.writeNeeded) return;
+
+/**
+ * Write a cached flash buffer out to flash if it has been changed.
+ * Will suspend the CPU.
+ * @param page the cached page to be written
+ */
+static void writeFlashBlock(uint8_t page) {
+    if (! flashFlags[page].writeNeeded) return;
     
     // Wait until App tells us it is a good time
     while (APP_isSuitableTimeToWriteFlash() == BAD_TIME)  // block awaiting a good time
         ;
         
-    if (flashFlags.eraseNeeded) {
-        eraseFlashBlock();
+    if (flashFlags[page].eraseNeeded) {
+        eraseFlashBlock(page);
     }
-    
+    programFlashBlock(page);
+}
+
+/**
+ * Write a flash buffer out to its flash block which must already have been 
+ * erased if necessary.
+ * Will suspend the CPU.
+ * @param page the cached page to be written
+ */
+static void programFlashBlock(uint8_t page) {
+#ifdef FLASH_WEAR_PAGES
+    flashBytesWritten += FLASH_PAGE_SIZE;
+#ifdef VLCB_DIAG
+    mnsDiagnostics[MNS_DIAGNOSTICS_FLASHWRITES].asUint++;
+#endif
+    wearChanged = 1;
+#endif
+#ifdef NVM_HOST
+    hostFlashWrite(flashBlock[page], PAGE_BUFFER(page));
+#else
+    uint8_t interruptEnabled;
+    PAUSE_EEPROM_QUEUE();
+#if defined (_18F66K80_FAMILY_)
+    TBLPTR = flashBlock[page]; //force row boundary
+    TBLPTRU = 0;
+#endif
+#if defined(_18FXXQ83_FAMILY_) && (FLASH_CACHE_PAGES > 1)
+    memcpy(nvmBuffer, PAGE_BUFFER(page), FLASH_PAGE_SIZE);
+#endif
     interruptEnabled = geti(); // store current global interrupt state
     bothDi();     // disable all interrupts ERRATA says this is needed before TBLWT
 #if defined (_18F66K80_FAMILY_)
     for (uint8_t i=0; i<FLASH_PAGE_SIZE; i++) {
-        TABLAT = flashBuffer[i];
+        TABLAT = PAGE_BUFFER(page)[i];
         asm("TBLWT*+");
     }
     // Note from data sheet: 
@@ -426,7 +1263,7 @@ void flushFlashBlock(void) {
     //   intended address range of the 64 bytes in
     //   the holding register.
     // So we put it back into the block here
-    TBLPTR = flashBlock;
+    TBLPTR = flashBlock[page];
     TBLPTRU = 0;
     EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
     EECON1bits.CFGS = 0;    // 0=ProgramMemory/EEPROM, 1=ConfigBits
@@ -446,7 +1283,7 @@ void flushFlashBlock(void) {
     /*NVMADRU = (uint8_t) (flashBlock >> 16);
     NVMADRH = (uint8_t) (flashBlock >> 8);
     NVMADRL = (uint8_t) flashBlock;*/
-    NVMADR = flashBlock;
+    NVMADR = flashBlock[page];
 
     NVMCON1bits.NVMCMD = NVMCMD_WRITEPAGE;      //Set the page write command
     //Perform the unlock sequence 
@@ -462,23 +1299,33 @@ void flushFlashBlock(void) {
     if (interruptEnabled) {     // Only enable interrupts if they were enabled at function entry
         bothEi();                   /* Enable Interrupts */
     }
-    flashFlags.asByte = 0;  // no erase, no write
+    RESUME_EEPROM_QUEUE();
+#endif
+    flashFlags[page].writeNeeded = 0;  // no erase, no write
+    flashFlags[page].eraseNeeded = 0;
 }
 
 /**
- * Load an entire block of flash into the flash buffer.
+ * Load an entire block of flash into a flash buffer.
+ * @param page the cached page to be loaded from its flash block
  */
-void loadFlashBlock(void) {
+static void loadFlashBlock(uint8_t page) {
+#ifdef NVM_HOST
+    for (uint16_t i=0; i<FLASH_PAGE_SIZE; i++) {
+        PAGE_BUFFER(page)[i] = hostFlashRead(flashBlock[page] + i);
+    }
+#else
+    PAUSE_EEPROM_QUEUE();
 #if defined (_18F66K80_FAMILY_)
     EECON1=0X80;    // access to flash
-    TBLPTR = flashBlock;
+    TBLPTR = flashBlock[page];
     TBLPTRU = 0;
-    for (uint8_t i=0; i<64; i++) {
+    for (uint8_t i=0; i<FLASH_PAGE_SIZE; i++) {
         asm("TBLRD*+");
         NOP();
-        flashBuffer[i] = TABLAT;
+        PAGE_BUFFER(page)[i] = TABLAT;
     }
-    TBLPTR = flashBlock;
+    TBLPTR = flashBlock[page];
     TBLPTRU = 0;
 #endif
 #if defined(_18FXXQ83_FAMILY_)
@@ -486,16 +1333,22 @@ void loadFlashBlock(void) {
     while (NVMCON0bits.GO)
         ;
     //Load NVMADR with the starting address of the memory page
-    NVMADRU = (uint8_t) (flashBlock >> 16);
-    NVMADRH = (uint8_t) (flashBlock >> 8);
-    NVMADRL = (uint8_t) flashBlock;
+    NVMADRU = (uint8_t) (flashBlock[page] >> 16);
+    NVMADRH = (uint8_t) (flashBlock[page] >> 8);
+    NVMADRL = (uint8_t) flashBlock[page];
     NVMCON1bits.NVMCMD = NVMCMD_READPAGE;      //Set the page read command
     NVMCON0bits.GO = 1;             //Start page read
     while (NVMCON0bits.GO)          // Wait to complete
         ;
     NVMCON1bits.NVMCMD = NVMCMD_NOP;      //Clear the NVM Command
+#if FLASH_CACHE_PAGES > 1
+    memcpy(PAGE_BUFFER(page), nvmBuffer, FLASH_PAGE_SIZE);
+#endif
+#endif
+    RESUME_EEPROM_QUEUE();
 #endif
-    flashFlags.asByte = 0; // no erase, no write needed
+    flashFlags[page].asByte = 0; // no erase, no write needed
+    flashFlags[page].loaded = 1;
 }
    
 /**
@@ -507,7 +1360,8 @@ void loadFlashBlock(void) {
  * @return 0 for success or error otherwise
  */
 uint8_t FLASH_Write(flash_address_t index, flash_data_t value) {
-    uint8_t oldValue;
+    uint8_t p;
+    uint8_t i;
     
     /*
      * Writing flash is a bit of a pain as you must write in blocks. If you want to
@@ -516,35 +1370,223 @@ uint8_t FLASH_Write(flash_address_t index, flash_data_t value) {
      * and then the whole buffer written. Unfortunately this algorithm would cause
      * too many writes to happen and the flash would wear out.
      * Instead after reading the block and updating the byte we don't write the
-     * buffer back in case there is another update within the same block. The 
-     * block is only written back if another block needs to be updated.
+     * buffer back in case there is another update within the same block. 
+     * FLASH_CACHE_PAGES blocks are held in buffers and a block is only written 
+     * back when its buffer is needed for another block, replacing the least 
+     * recently written block, when the buffers have been quiet for a while 
+     * or when a flush is requested.
      * Whilst writing back if any bit changes from 0 to 1 then the block needs
      * to be erased before writing.
      *
      */
-    if (BLOCK(index) != flashBlock) {
-        if (flashBlock != 0) {
-            // ok we want to write a different block so flush the current block 
-            if (flashFlags.eraseNeeded) {
-                eraseFlashBlock();
-                flashFlags.eraseNeeded = 0;
-            }
-
-            flushFlashBlock();
-        }
+    p = findFlashPage(BLOCK(index));
+    if (p == NO_PAGE) {
+        // ok we want to write a block which isn't cached so flush the least
+        // recently written block
+        p = flashOrder[FLASH_CACHE_PAGES-1];
+        writeFlashBlock(p);
         
         // and load the new one
-        flashBlock = BLOCK(index);
-        loadFlashBlock();
+        flashBlock[p] = BLOCK(index);
+        loadFlashBlock(p);
+    }
+    // move to the front as the most recently written
+    for (i=0; flashOrder[i] != p; i++)
+        ;
+    for (; i>0; i--) {
+        flashOrder[i] = flashOrder[i-1];
+    }
+    flashOrder[0] = p;
+    
+    flashFlags[p].eraseNeeded |= (value & ~PAGE_BUFFER(p)[OFFSET(index)])?1:0;
+    if (PAGE_BUFFER(p)[OFFSET(index)] != value) {
+        flashFlags[p].writeNeeded = 1;
+        PAGE_BUFFER(p)[OFFSET(index)] = value;
+        flashWriteTime.val = tickGet();
+        if (! flashDirty) {
+            flashDirty = 1;
+            flashDirtyTime.val = flashWriteTime.val;
+        }
+#ifdef FLASH_WEAR_PAGES
+        flashBytesChanged++;
+#endif
     }
-    flashFlags.eraseNeeded |= (value & ~flashBuffer[OFFSET(index)])?1:0;
-    if (flashBuffer[OFFSET(index)] != value) {
-        flashFlags.writeNeeded = 1;
-        flashBuffer[OFFSET(index)] = value;
+    return GRSP_OK;
+}
+
+/*
+ * Backend functions for EEPROM.
+ */
+static int16_t eepromBackendRead(uint24_t index) {
+    return EEPROM_Read((eeprom_address_t)index);
+}
+
+static uint8_t eepromBackendWrite(uint24_t index, uint8_t value) {
+    return EEPROM_Write((eeprom_address_t)index, value);
+}
+
+static uint8_t eepromBackendReadBlock(uint24_t index, uint8_t * buffer, uint8_t length) {
+    for (; length > 0; length--) {
+        *buffer++ = EEPROM_Read((eeprom_address_t)index++);
+    }
+    return GRSP_OK;
+}
+
+static uint8_t eepromBackendWriteBlock(uint24_t index, const uint8_t * buffer, uint8_t length) {
+    uint8_t error;
+    for (; length > 0; length--, index++, buffer++) {
+        // skip bytes which are unchanged to save a write cycle each
+        if (EEPROM_Read((eeprom_address_t)index) != *buffer) {
+            error = EEPROM_Write((eeprom_address_t)index, *buffer);
+            if (error != GRSP_OK) {
+                return error;
+            }
+        }
+    }
+    return GRSP_OK;
+}
+
+static uint8_t eepromBackendFill(uint24_t index, uint8_t value, uint24_t length) {
+    return EEPROM_Fill((eeprom_address_t)index, value, length);
+}
+
+/**
+ * The backend for the PIC's data EEPROM.
+ */
+static const NvmBackend eepromBackend = {
+    eepromBackendRead,
+    eepromBackendWrite,
+    eepromBackendReadBlock,
+    eepromBackendWriteBlock,
+    flushEepromQueue,
+    eepromBackendFill
+};
+
+/*
+ * Backend functions for Flash.
+ */
+static int16_t flashBackendRead(uint24_t index) {
+    return FLASH_Read((flash_address_t)index);
+}
+
+static uint8_t flashBackendWrite(uint24_t index, uint8_t value) {
+    return FLASH_Write((flash_address_t)index, value);
+}
+
+static uint8_t flashBackendReadBlock(uint24_t index, uint8_t * buffer, uint8_t length) {
+    FLASH_ReadBlock((flash_address_t)index, buffer, length);
+    return GRSP_OK;
+}
+
+static uint8_t flashBackendWriteBlock(uint24_t index, const uint8_t * buffer, uint8_t length) {
+    for (; length > 0; length--) {
+        FLASH_Write((flash_address_t)index++, *buffer++);
+    }
+    return GRSP_OK;
+}
+
+static uint8_t flashBackendFill(uint24_t index, uint8_t value, uint24_t length) {
+    if (value == 0xFF) {
+        FLASH_Erase((flash_address_t)index, length);
+    } else {
+        for (; length > 0; length--) {
+            FLASH_Write((flash_address_t)index++, value);
+        }
     }
     return GRSP_OK;
 }
 
+/**
+ * The backend for the PIC's program Flash.
+ */
+static const NvmBackend flashBackend = {
+    flashBackendRead,
+    flashBackendWrite,
+    flashBackendReadBlock,
+    flashBackendWriteBlock,
+    flushFlashBlock,
+    flashBackendFill
+};
+
+#ifdef RAM_NVM_SIZE
+/*
+ * Backend functions for RAM. The contents are lost at power off.
+ */
+static uint8_t ramNvm[RAM_NVM_SIZE];
+
+static int16_t ramBackendRead(uint24_t index) {
+    if (index >= RAM_NVM_SIZE) return -GRSP_UNKNOWN_NVM_TYPE;
+    return ramNvm[index];
+}
+
+static uint8_t ramBackendWrite(uint24_t index, uint8_t value) {
+    if (index >= RAM_NVM_SIZE) return GRSP_UNKNOWN_NVM_TYPE;
+    ramNvm[index] = value;
+    return GRSP_OK;
+}
+
+static uint8_t ramBackendReadBlock(uint24_t index, uint8_t * buffer, uint8_t length) {
+    if (index + length > RAM_NVM_SIZE) return GRSP_UNKNOWN_NVM_TYPE;
+    memcpy(buffer, &ramNvm[index], length);
+    return GRSP_OK;
+}
+
+static uint8_t ramBackendWriteBlock(uint24_t index, const uint8_t * buffer, uint8_t length) {
+    if (index + length > RAM_NVM_SIZE) return GRSP_UNKNOWN_NVM_TYPE;
+    memcpy(&ramNvm[index], buffer, length);
+    return GRSP_OK;
+}
+
+static uint8_t ramBackendFill(uint24_t index, uint8_t value, uint24_t length) {
+    if (index + length > RAM_NVM_SIZE) return GRSP_UNKNOWN_NVM_TYPE;
+    memset(&ramNvm[index], value, length);
+    return GRSP_OK;
+}
+
+/**
+ * The backend for volatile tables held in RAM.
+ */
+static const NvmBackend ramBackend = {
+    ramBackendRead,
+    ramBackendWrite,
+    ramBackendReadBlock,
+    ramBackendWriteBlock,
+    NULL,
+    ramBackendFill
+};
+#endif
+
+/**
+ * The backend used for each NVM type. EXTERNAL_NVM_TYPE, and RAM_NVM_TYPE 
+ * without RAM_NVM_SIZE, have no backend until one is registered.
+ */
+static const NvmBackend * nvmBackends[NUM_NVM_TYPES] = {
+    &eepromBackend,
+    &flashBackend,
+#ifdef RAM_NVM_SIZE
+    &ramBackend,
+#else
+    NULL,
+#endif
+    NULL
+};
+
+/** Provides whether the NVM type has a backend.*/
+#define HAS_BACKEND(t)  (((t) < NUM_NVM_TYPES) && (nvmBackends[t] != NULL))
+
+/**
+ * Register the backend to be used for a type of NVM. Used by the application
+ * to provide external memory such as SPI FRAM or EEPROM, or to replace one of 
+ * the built in backends.
+ * @param type the type of memory
+ * @param backend the functions to access the memory or NULL to remove
+ */
+void registerNvmBackend(NVMtype type, const NvmBackend * backend) {
+    if (type < NUM_NVM_TYPES) {
+        nvmBackends[type] = backend;
+    }
+}
+
 /**
  * Write a single byte to NVM.
  * @param type the type of memory to access
@@ -553,14 +1595,8 @@ uint8_t FLASH_Write(flash_address_t index, flash_data_t value) {
  * @return 0 for success, error otherwise
  */
 uint8_t writeNVM(NVMtype type, uint24_t index, uint8_t value) {
-    switch(type) {
-        case EEPROM_NVM_TYPE:
-            return EEPROM_Write((eeprom_address_t)index, value);
-        case FLASH_NVM_TYPE:
-            return FLASH_Write((flash_address_t)index, value);
-        default:
-            return GRSP_UNKNOWN_NVM_TYPE;
-    }
+    if (! HAS_BACKEND(type)) return GRSP_UNKNOWN_NVM_TYPE;
+    return nvmBackends[type]->write(index, value);
 }
 
 /**
@@ -570,18 +1606,87 @@ uint8_t writeNVM(NVMtype type, uint24_t index, uint8_t value) {
  * @return the value if >=0, -error otherwise
  */
 int16_t readNVM(NVMtype type, uint24_t index) {
-    switch(type) {
-        case EEPROM_NVM_TYPE:
-            return EEPROM_Read((uint16_t)index);
-        case FLASH_NVM_TYPE:
-#if defined(_18F66K80_FAMILY_)
-            return FLASH_Read((uint16_t)index);
-#endif
-#if defined(_18FXXQ83_FAMILY_)
-            return FLASH_Read(index);
-#endif
-        default:
-            return -GRSP_UNKNOWN_NVM_TYPE;
+    if (! HAS_BACKEND(type)) return -GRSP_UNKNOWN_NVM_TYPE;
+    return nvmBackends[type]->read(index);
+}
+
+/**
+ * Read a sequence of bytes of NVM. Faster than calling readNVM() for each byte.
+ * @param type the type of memory to be accessed
+ * @param index the address of the first byte
+ * @param buffer where the bytes are to be put
+ * @param length the number of bytes
+ * @return 0 for success, error otherwise
+ */
+uint8_t readNVMBlock(NVMtype type, uint24_t index, uint8_t * buffer, uint8_t length) {
+    if (! HAS_BACKEND(type)) return GRSP_UNKNOWN_NVM_TYPE;
+    return nvmBackends[type]->readBlock(index, buffer, length);
+}
+
+/**
+ * Write a sequence of bytes to NVM.
+ * @param type the type of memory to be accessed
+ * @param index the address of the first byte
+ * @param buffer the bytes to be written
+ * @param length the number of bytes
+ * @return 0 for success, error otherwise
+ */
+uint8_t writeNVMBlock(NVMtype type, uint24_t index, const uint8_t * buffer, uint8_t length) {
+    if (! HAS_BACKEND(type)) return GRSP_UNKNOWN_NVM_TYPE;
+    return nvmBackends[type]->writeBlock(index, buffer, length);
+}
+
+/**
+ * Set a range of NVM to one value. Faster than calling writeNVM() for each 
+ * byte, in particular filling Flash pages with 0xFF erases them without 
+ * programming.
+ * @param type the type of memory to be accessed
+ * @param index the address of the first byte
+ * @param value the value to be written
+ * @param length the number of bytes
+ * @return 0 for success, error otherwise
+ */
+uint8_t fillNVM(NVMtype type, uint24_t index, uint8_t value, uint24_t length) {
+    uint8_t error;
+    if (! HAS_BACKEND(type)) return GRSP_UNKNOWN_NVM_TYPE;
+    if (nvmBackends[type]->fill != NULL) {
+        return nvmBackends[type]->fill(index, value, length);
+    }
+    for (; length > 0; length--) {
+        error = nvmBackends[type]->write(index++, value);
+        if (error != GRSP_OK) {
+            return error;
+        }
+    }
+    return GRSP_OK;
+}
+
+/**
+ * Ensure that all writes to a type of NVM have been completed.
+ * @param type the type of memory
+ */
+void flushNVM(NVMtype type) {
+    if (HAS_BACKEND(type) && (nvmBackends[type]->flush != NULL)) {
+        nvmBackends[type]->flush();
+    }
+}
+
+/**
+ * Request that all writes to a type of NVM are completed. Only the PIC's
+ * Flash is written out by pollNVM() without blocking, unless the application
+ * has registered its own backend for it, other types are flushed before this
+ * returns.
+ * @param type the type of memory
+ * @param callback function called when complete or NULL
+ */
+void requestNVMFlush(NVMtype type, FlashFlushCallback callback) {
+    if ((type == FLASH_NVM_TYPE) && (nvmBackends[type] == &flashBackend)) {
+        requestFlashFlush(callback);
+        return;
+    }
+    flushNVM(type);
+    if (callback != NULL) {
+        callback();
     }
 }
 
@@ -63,13 +63,31 @@
 
 /**
  *  NVM types. These facilitate the Application code to easily control whether
- * persistent data is stored in Flash or EEPROM.
+ * persistent data is stored in Flash or EEPROM. RAM_NVM_TYPE is volatile RAM
+ * of RAM_NVM_SIZE bytes if that is defined in module.h. EXTERNAL_NVM_TYPE is
+ * for memory, such as SPI FRAM, whose backend is provided by the application.
  */
 typedef enum {
     EEPROM_NVM_TYPE,
-    FLASH_NVM_TYPE
+    FLASH_NVM_TYPE,
+    RAM_NVM_TYPE,
+    EXTERNAL_NVM_TYPE,
+    NUM_NVM_TYPES
 } NVMtype;
 
+/**
+ * The functions which access one type of NVM. readNVM(), writeNVM() etc. call
+ * the backend registered for the type.
+ */
+typedef struct {
+    int16_t (* read)(uint24_t index);      ///< read a byte, negative is an error
+    uint8_t (* write)(uint24_t index, uint8_t value);      ///< write a byte
+    uint8_t (* readBlock)(uint24_t index, uint8_t * buffer, uint8_t length);      ///< read a sequence of bytes
+    uint8_t (* writeBlock)(uint24_t index, const uint8_t * buffer, uint8_t length);   ///< write a sequence of bytes
+    void (* flush)(void);      ///< complete any outstanding writes, may be NULL
+    uint8_t (* fill)(uint24_t index, uint8_t value, uint24_t length);  ///< set a range to a value, may be NULL
+} NvmBackend;
+
 /**
  * Indicates whether the current time is good or bad. 
  */
@@ -125,6 +143,19 @@ typedef uint8_t eeprom_data_t;
 typedef uint16_t eeprom_address_t;
 #endif
 
+#if defined(_18F66K80_FAMILY_)
+/**
+ * Contains the size of a Flash page in bytes.
+ */
+#define FLASH_PAGE_SIZE _FLASH_ERASE_SIZE
+#endif
+#if defined(_18FXXQ83_FAMILY_)
+/**
+ * Contains the size of a Flash page in bytes.
+ */
+#define FLASH_PAGE_SIZE          (256U)
+#endif
+
 /*
  * Processor specific settings
  */
@@ -146,6 +177,23 @@ typedef uint16_t eeprom_address_t;
  */
 extern void flushFlashBlock(void);
 
+/**
+ * Function called when a flush requested by requestFlashFlush() is complete.
+ */
+typedef void (*FlashFlushCallback)(void);
+
+/**
+ * Request that the Flash cached in RAM is written out by pollNVM() without blocking.
+ * A NULL callback does not cancel the callback of an earlier request.
+ * @param callback function called when complete or NULL
+ */
+extern void requestFlashFlush(FlashFlushCallback callback);
+
+/**
+ * Perform the next step of a requested flush. Called from the VLCB poll loop.
+ */
+extern void pollNVM(void);
+
 /*
  * Initialise the Romops functions. Sets the flash buffer as being currently unused. 
  */
@@ -159,6 +207,16 @@ extern void initRomOps(void);
  */
 extern int16_t readNVM(NVMtype type, uint24_t index);
 
+/*
+ * Read a sequence of bytes from NVM.
+ * @param type specify the type of NVM required
+ * @param index is the address of the first byte to be read
+ * @param buffer where the bytes read are put
+ * @param length the number of bytes to be read
+ * @return 0 for success or error number
+ */
+extern uint8_t readNVMBlock(NVMtype type, uint24_t index, uint8_t * buffer, uint8_t length);
+
 /*
  * Write a byte to NVM with verification of success.
  * Goes through a write/read/verify loop until read matches written data.
@@ -170,6 +228,47 @@ extern int16_t readNVM(NVMtype type, uint24_t index);
  */
 extern uint8_t writeNVM(NVMtype type, uint24_t index, uint8_t value);
 
+/*
+ * Write a sequence of bytes to NVM.
+ * @param type specify the type of NVM required
+ * @param index is the address of the first byte to be written
+ * @param buffer the bytes to be written
+ * @param length the number of bytes to be written
+ * @return 0 for success or error number
+ */
+extern uint8_t writeNVMBlock(NVMtype type, uint24_t index, const uint8_t * buffer, uint8_t length);
+
+/*
+ * Set a range of NVM to one value. Flash pages filled with 0xFF are erased.
+ * @param type specify the type of NVM required
+ * @param index is the address of the first byte to be written
+ * @param value the byte value to be written
+ * @param length the number of bytes to be written
+ * @return 0 for success or error number
+ */
+extern uint8_t fillNVM(NVMtype type, uint24_t index, uint8_t value, uint24_t length);
+
+/*
+ * Ensure that all writes to a type of NVM have been completed.
+ * @param type specify the type of NVM required
+ */
+extern void flushNVM(NVMtype type);
+
+/*
+ * Request that all writes to a type of NVM are completed. Flash is written out
+ * by pollNVM() without blocking, other types are flushed straight away.
+ * @param type specify the type of NVM required
+ * @param callback function called when complete or NULL
+ */
+extern void requestNVMFlush(NVMtype type, FlashFlushCallback callback);
+
+/*
+ * Register the backend used to access a type of NVM.
+ * @param type specify the type of NVM
+ * @param backend the backend functions or NULL
+ */
+extern void registerNvmBackend(NVMtype type, const NvmBackend * backend);
+
 /*
  * Write a byte to EEPROM without verification.
  * @param type specify the type of NVM required
@@ -179,6 +278,20 @@ extern uint8_t writeNVM(NVMtype type, uint24_t index, uint8_t value);
  */
 extern uint8_t EEPROM_WriteNoVerify(eeprom_address_t index, eeprom_data_t value);
 
+/**
+ * Wait until all queued and shadowed EEPROM writes have been completed. Must
+ * be called before a RESET() when EEPROM_WRITE_QUEUE or EEPROM_SHADOW_SIZE 
+ * is defined. Changed flash buffers are no longer written out every second so
+ * flushFlashBlock() must also be called before a RESET().
+ */
+extern void flushEepromQueue(void);
+
+/**
+ * Service the EEPROM write queue from the low priority interrupt.
+ * Only used on the K80 when EEPROM_WRITE_QUEUE is defined.
+ */
+extern void nvmLowIsr(void);
+
 /**
  * Call back into the application to check if now is a good time to write the flash
  * as the processor will be suspended for up to 2ms.
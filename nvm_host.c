@@ -0,0 +1,225 @@
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * @brief
+ * Emulation of the PIC's Flash and EEPROM for host builds.
+ * @details
+ * See nvm_host.h for a description of the emulation.
+ */
+
+#include "module.h"
+
+#ifdef NVM_HOST
+// POSIX headers which XC8 does not have so only included for a host build
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nvm_host.h"
+
+#ifndef HOST_NVM_IMAGE
+#define HOST_NVM_IMAGE          "nvm.img"
+#endif
+
+#if defined(_18FXXQ83_FAMILY_)
+#ifndef HOST_FLASH_ERASE_US
+#define HOST_FLASH_ERASE_US     11000
+#endif
+#ifndef HOST_FLASH_WRITE_US
+#define HOST_FLASH_WRITE_US     11000
+#endif
+#ifndef HOST_EEPROM_WRITE_US
+#define HOST_EEPROM_WRITE_US    11000
+#endif
+#endif
+#if defined(_18F66K80_FAMILY_)
+#ifndef HOST_FLASH_ERASE_US
+#define HOST_FLASH_ERASE_US     2000
+#endif
+#ifndef HOST_FLASH_WRITE_US
+#define HOST_FLASH_WRITE_US     2000
+#endif
+#ifndef HOST_EEPROM_WRITE_US
+#define HOST_EEPROM_WRITE_US    4000
+#endif
+#endif
+
+/** The size of the image file.*/
+#define HOST_IMAGE_SIZE         (HOST_EEPROM_BASE + HOST_EEPROM_SIZE)
+
+HostNvmStats hostNvmStats;
+static uint8_t * image;     ///< the memory mapped image file
+
+/**
+ * Account for the CPU being stalled by an NVM operation.
+ * @param micros the modelled duration
+ */
+static void stall(uint32_t micros) {
+    hostNvmStats.stallMicros += micros;
+#ifdef HOST_NVM_DELAY
+    usleep(micros);
+#endif
+}
+
+/**
+ * Open, or create, the image file. Called by initRomOps().
+ */
+void hostNvmOpen(void) {
+    const char * name;
+    int fd;
+    off_t size;
+    
+    if (image != NULL) return;
+    name = getenv("NVM_IMAGE");
+    if (name == NULL) {
+        name = HOST_NVM_IMAGE;
+    }
+    fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    size = lseek(fd, 0, SEEK_END);
+    if ((size < (off_t)HOST_IMAGE_SIZE) && (ftruncate(fd, HOST_IMAGE_SIZE) != 0)) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    image = mmap(NULL, HOST_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    if (size == 0) {
+        // a new image starts erased
+        memset(image, 0xFF, HOST_IMAGE_SIZE);
+    }
+    hostNvmResetStats();
+}
+
+/**
+ * Read a byte of EEPROM.
+ * @param index the EEPROM address
+ * @return the value
+ */
+uint8_t hostEepromRead(eeprom_address_t index) {
+    hostNvmStats.eepromReads++;
+    return image[HOST_EEPROM_BASE + index % HOST_EEPROM_SIZE];
+}
+
+/**
+ * Write a byte of EEPROM.
+ * @param index the EEPROM address
+ * @param value the value to be written
+ */
+void hostEepromWrite(eeprom_address_t index, uint8_t value) {
+    image[HOST_EEPROM_BASE + index % HOST_EEPROM_SIZE] = value;
+    hostNvmStats.eepromWrites++;
+    stall(HOST_EEPROM_WRITE_US);
+}
+
+/**
+ * Read a byte of Flash.
+ * @param address the Flash address
+ * @return the value
+ */
+uint8_t hostFlashRead(flash_address_t address) {
+    hostNvmStats.flashReads++;
+    return image[address % HOST_FLASH_SIZE];
+}
+
+/**
+ * Erase a Flash page to 0xFF.
+ * @param block the address of the start of the page
+ */
+void hostFlashErase(flash_address_t block) {
+    block %= HOST_FLASH_SIZE;
+    memset(&image[block], 0xFF, FLASH_PAGE_SIZE);
+    hostNvmStats.pageErases[block / FLASH_PAGE_SIZE]++;
+    stall(HOST_FLASH_ERASE_US);
+}
+
+/**
+ * Write a Flash page. Bits can only be cleared.
+ * @param block the address of the start of the page
+ * @param data FLASH_PAGE_SIZE bytes to be written
+ */
+void hostFlashWrite(flash_address_t block, const uint8_t * data) {
+    uint16_t i;
+    
+    block %= HOST_FLASH_SIZE;
+    for (i=0; i<FLASH_PAGE_SIZE; i++) {
+        image[block + i] &= data[i];    // programming can only clear bits
+    }
+    hostNvmStats.pageWrites[block / FLASH_PAGE_SIZE]++;
+    stall(HOST_FLASH_WRITE_US);
+}
+
+/**
+ * Clear the counts in hostNvmStats.
+ */
+void hostNvmResetStats(void) {
+    memset(&hostNvmStats, 0, sizeof(hostNvmStats));
+}
+
+/**
+ * Print a summary of hostNvmStats.
+ * @param f where to print
+ */
+void hostNvmReport(FILE * f) {
+    uint32_t p;
+    uint32_t erases = 0;
+    uint32_t writes = 0;
+    uint32_t most = 0;
+    
+    for (p=0; p<HOST_FLASH_PAGES; p++) {
+        erases += hostNvmStats.pageErases[p];
+        writes += hostNvmStats.pageWrites[p];
+        if (hostNvmStats.pageErases[p] > hostNvmStats.pageErases[most]) {
+            most = p;
+        }
+        if (hostNvmStats.pageErases[p] || hostNvmStats.pageWrites[p]) {
+            fprintf(f, "page 0x%06lX erases %lu writes %lu\n", (unsigned long)(p*FLASH_PAGE_SIZE),
+                    (unsigned long)hostNvmStats.pageErases[p], (unsigned long)hostNvmStats.pageWrites[p]);
+        }
+    }
+    fprintf(f, "flash erases %lu writes %lu, most erased page 0x%06lX\n", (unsigned long)erases, 
+            (unsigned long)writes, (unsigned long)(most*FLASH_PAGE_SIZE));
+    fprintf(f, "flash reads %lu\n", (unsigned long)hostNvmStats.flashReads);
+    fprintf(f, "eeprom reads %lu writes %lu\n", (unsigned long)hostNvmStats.eepromReads, 
+            (unsigned long)hostNvmStats.eepromWrites);
+    fprintf(f, "stalled %lu us\n", (unsigned long)hostNvmStats.stallMicros);
+}
+
+#endif
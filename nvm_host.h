@@ -0,0 +1,150 @@
+#ifndef _NVM_HOST_H_
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+#define _NVM_HOST_H_
+
+#include <stdio.h>
+#include "xc.h"
+#include "module.h"
+#include "nvm.h"
+
+/**
+ * @file
+ * @brief
+ * Emulation of the PIC's Flash and EEPROM for host builds.
+ * @details
+ * When nvm.c is compiled with NVM_HOST defined the accesses to the PIC's Flash
+ * and EEPROM are passed to these functions instead of the NVM registers. The 
+ * memories are held in a memory mapped image file laid out like the device, 
+ * Flash from address 0 and EEPROM from 0x380000 on the Q83. The K80's EEPROM
+ * is not in the program address space so it follows the Flash in the image. 
+ * A new image is created erased (0xFF).
+ * 
+ * Flash is erased and written a page (FLASH_PAGE_SIZE, 64 bytes on the K80 and
+ * 256 on the Q83) at a time and writing can only clear bits, as on the device,
+ * so nvm.c's decisions of when to erase are emulated exactly.
+ * 
+ * The erases and writes of each Flash page, the bytes read from Flash and 
+ * EEPROM and the EEPROM writes are counted in hostNvmStats together with the 
+ * time the PIC would have been stalled. Reads of a page held in the Flash 
+ * cache are RAM reads and are not counted.
+ * 
+ * nvm.c does not use the PIC registers with NVM_HOST so a host build only
+ * needs the small xc.h in the host directory, where the Makefile builds nvm.c
+ * and nvm_host.c with the nvmtest.c test program. The EEPROM write queue is 
+ * interrupt driven and cannot be used with NVM_HOST.
+ * 
+ * # Module.h definitions
+ * - \#define NVM_HOST          Use the host emulation.
+ * - \#define HOST_NVM_IMAGE    The default image file name. The NVM_IMAGE 
+ *                       environment variable overrides it.
+ * - \#define HOST_NVM_DELAY    Sleep for the modelled erase and write times
+ *                       rather than only recording them.
+ * - \#define HOST_FLASH_ERASE_US, HOST_FLASH_WRITE_US, HOST_EEPROM_WRITE_US
+ *                       The modelled times in microseconds. The defaults 
+ *                       are approximate and should be checked against the 
+ *                       device data sheet.
+ */
+
+#if defined(_18FXXQ83_FAMILY_)
+#define HOST_FLASH_SIZE         0x20000UL   ///< Bytes of program Flash
+#define HOST_EEPROM_BASE        0x380000UL  ///< Address of the EEPROM in the image
+#endif
+#if defined(_18F66K80_FAMILY_)
+#define HOST_FLASH_SIZE         0x10000UL   ///< Bytes of program Flash
+#define HOST_EEPROM_BASE        HOST_FLASH_SIZE ///< Address of the EEPROM in the image
+#endif
+#define HOST_EEPROM_SIZE        1024UL      ///< Bytes of EEPROM
+/** The number of Flash pages.*/
+#define HOST_FLASH_PAGES        (HOST_FLASH_SIZE/FLASH_PAGE_SIZE)
+
+/**
+ * Counts of the NVM operations performed.
+ */
+typedef struct {
+    uint32_t pageErases[HOST_FLASH_PAGES];  ///< erases of each Flash page
+    uint32_t pageWrites[HOST_FLASH_PAGES];  ///< writes of each Flash page
+    uint32_t flashReads;                    ///< bytes read from Flash
+    uint32_t eepromReads;                   ///< EEPROM byte reads
+    uint32_t eepromWrites;                  ///< EEPROM byte writes
+    uint32_t stallMicros;                   ///< modelled time the CPU was stalled
+} HostNvmStats;
+
+/**
+ * The counts since the image was opened or hostNvmResetStats() was called.
+ */
+extern HostNvmStats hostNvmStats;
+
+/**
+ * Open, or create, the image file. Called by initRomOps().
+ */
+extern void hostNvmOpen(void);
+/**
+ * Read a byte of EEPROM.
+ * @param index the EEPROM address
+ * @return the value
+ */
+extern uint8_t hostEepromRead(eeprom_address_t index);
+/**
+ * Write a byte of EEPROM.
+ * @param index the EEPROM address
+ * @param value the value to be written
+ */
+extern void hostEepromWrite(eeprom_address_t index, uint8_t value);
+/**
+ * Read a byte of Flash.
+ * @param address the Flash address
+ * @return the value
+ */
+extern uint8_t hostFlashRead(flash_address_t address);
+/**
+ * Erase a Flash page to 0xFF.
+ * @param block the address of the start of the page
+ */
+extern void hostFlashErase(flash_address_t block);
+/**
+ * Write a Flash page. Bits can only be cleared.
+ * @param block the address of the start of the page
+ * @param data FLASH_PAGE_SIZE bytes to be written
+ */
+extern void hostFlashWrite(flash_address_t block, const uint8_t * data);
+/**
+ * Clear the counts in hostNvmStats.
+ */
+extern void hostNvmResetStats(void);
+/**
+ * Print a summary of hostNvmStats.
+ * @param f where to print
+ */
+extern void hostNvmReport(FILE * f);
+
+#endif
@@ -746,13 +746,6 @@ static Message tmpMessage;
 static TickValue timedResponseTime;
 static uint8_t timedResponseDelay;
 
-
-/**
- * Used to control how often it is checked whether any of the flash buffer
- * needs to be flushed out to permanent storage.
- */
-static TickValue flashFlushTime;
-
 /** 
  * Function that must be provided by the application. 
  * Called when a message is received and before the message is processed 
@@ -1012,10 +1005,7 @@ static void poll(void) {
         pollTimedResponse();
         timedResponseTime.val = tickGet();
     }
-    if (tickTimeSince(flashFlushTime) > ONE_SECOND) {
-        flushFlashBlock();
-        flashFlushTime.val = tickGet();
-    }
+    pollNVM();
     /* call any service polls */
     for (i=0; i<NUM_SERVICES; i++) {
         if ((services[i] != NULL) && (services[i]->poll != NULL)) {
@@ -1089,6 +1079,9 @@ static void highIsr(void) {
 static void lowIsr(void) {
     uint8_t i;
     
+#ifdef EEPROM_WRITE_QUEUE
+    nvmLowIsr();
+#endif
     for (i=0; i<NUM_SERVICES; i++) {
         if ((services[i] != NULL) && (services[i]->lowIsr != NULL)) {
             services[i]->lowIsr();